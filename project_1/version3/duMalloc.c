@@ -1,353 +1,4115 @@
+#define _GNU_SOURCE // mremap
 #include "duMalloc.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <ctype.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <limits.h>
+#include <time.h>
+#if defined(__AVX2__) || defined(__SSE4_1__)
+#include <immintrin.h>
+#endif
 
 // Defining heap size
-#define HEAP_SIZE (128 * 8)
+#define HEAP_SIZE (128 * 8)                 // default heap size used by duInitMalloc
+#define HEAP_RESERVE ((size_t)16 << 30)     // address space reserved for each heap so it can grow in place
+#define HEAP_PAGE 4096                      // heaps are mapped in whole pages
+#define MAX_DUMP_MAP 1024                   // largest heap (in 8 byte units) drawn by duMemoryDump
 #define USED 0
 #define FREE 1
-#define ROWS 2             // number of rows (current and new heaps as the rows)
-#define COLS HEAP_SIZE / 8 // number of columns (size and memory location as the columns)
+#define ROWS 3     // number of rows (current and new young heaps, then the old heap)
+#define OLD_HEAP 2 // row of the old generation
+#define PROMOTION_AGE 2 // default number of minor collections survived before promotion
+#define DEFAULT_ALIGNMENT 8 // every payload is at least this aligned
+#define RELEASE_MIN_BYTES ((size_t)256 << 10) // smaller evacuated young heaps keep their pages, refaulting costs more
+#define LARGE_OBJECT_THRESHOLD ((size_t)128 << 10) // default size from which managed blocks get a mapping of their own
 
-void *managedList[HEAP_SIZE / 8] = {NULL}; // Managed List
-int managedListSize = 0;                   // Size of the Managed List
+void **managedList = NULL;   // Managed List, reserved up front so handles never move
+int managedListSize = 0;     // Size of the Managed List, slots past it have never been used
+int managedListCapacity = 0; // Slots mapped so far
+unsigned int *managedGenerations = NULL; // bumped each time a slot is freed, to spot stale handles
 
+// Reachability, typed blocks live only while the roots reach them through handles in typed blocks
+// untyped blocks keep the old rule of living until they are freed, and act as roots
+const duType **managedTypes = NULL; // type of each slot's block, NULL when untyped
+unsigned char *managedMarks = NULL; // set on the slots the last mark phase reached
+int *markStack = NULL;              // marked typed slots whose handles are still to be followed
+unsigned char *managedAlignments = NULL; // log2 of the alignment each slot's block must keep when it moves, 0 for none
+int typedBlockCount = 0;            // the mark phase is skipped while there are none
+duType *loadedTypes = NULL;         // copies of the types a loaded heap snapshot was saved with, one allocation
+void ****roots = NULL;              // variables registered with duAddRoot, each holding a handle or NULL
+int rootCount = 0;
+int rootCapacity = 0;
+int managedFreeSlot = -1;                // first vacated slot, the rest are chained through managedNextFree
+int *managedNextFree = NULL;             // the vacated slot after each vacated one, so vacated slots stay NULL
+
+#define SLOT_IN_USE(slot) ((slot) != NULL)
+
+#ifdef COMPACT_HEADER
+// Compact layout, built with -DCOMPACT_HEADER: one word in front of every block and one behind it
+// free blocks keep their list links in the payload, used blocks keep their managed index, age and
+// owning cache in a tag word where a free block has its footer
+typedef struct memoryBlockHeader
+{
+    size_t sizeAndFree; // size of the reserved block, the low bit is set while it is free
+} memoryBlockHeader;
+
+typedef struct freeLinks
+{
+    struct memoryBlockHeader *next; // the next block in the integrated free list
+    struct memoryBlockHeader *prev; // the previous block in the integrated free list
+} freeLinks;
+
+#define MIN_PAYLOAD sizeof(freeLinks) // every block must be able to hold its links once freed
+#define USED_TAG 1                    // low bit of a used block's tag, a free block's footer is a multiple of 8
+#else
 // Structure for memory block header
 typedef struct memoryBlockHeader
 {
-    int free;                       // 0 - used, 1 = free
-    int size;                       // size of the reserved block
-    int managedIndex;               // index of the block in the managed list
+    unsigned int free : 1;          // 0 - used, 1 = free
+    unsigned int age : 8;           // minor collections a managed block has survived
+    int managedIndex;               // index of the block in the managed list, -1 if unmanaged
+    size_t size;                    // size of the reserved block
     struct memoryBlockHeader *next; // the next block in the integrated free list
+    union
+    {
+        struct memoryBlockHeader *prev; // the previous block in the integrated free list
+        struct threadCache *owner;      // the thread cache a used small block belongs to, NULL if none
+    };
 
 } memoryBlockHeader;
 
+#define MIN_PAYLOAD 0
+#endif
+
+// Boundary tag at the end of every block, so a block can find its physical predecessor
+typedef struct memoryBlockFooter
+{
+    size_t size; // copy of the header size, or with COMPACT_HEADER the tag of a used block
+} memoryBlockFooter;
+
+#define BLOCK_OVERHEAD (sizeof(memoryBlockHeader) + sizeof(memoryBlockFooter))
+#define MIN_BLOCK (BLOCK_OVERHEAD + MIN_PAYLOAD) // smallest space that can be split off as a block
+
 // global variables
-unsigned char heap[ROWS][COLS]; // 2d array heap
+unsigned char *heap[ROWS]; // young and old heaps, each a reserved range mapped up to heapSize
+size_t heapSize[ROWS];     // bytes in use by each heap, the two young heaps always match
+size_t heapMapped[ROWS];   // bytes of each heap backed by mappings
+size_t heapReserve = 0;    // bytes of address space reserved for each heap
+size_t initSize = 0;       // size of each heap at init, before any growth
+int promotionAge = PROMOTION_AGE;
+size_t largeObjectThreshold = LARGE_OBJECT_THRESHOLD; // 0 keeps every managed block in the heaps
+
+// Collection policy for duManagedMalloc, a full young heap always triggers a minor collection
+double collectionOccupancy = 0;  // also collect once this fraction of the young heap is in use, 0 for never
+size_t collectionBudget = 0;     // also collect after this many bytes were allocated, 0 for never
+size_t bytesSinceCollection = 0; // young bytes handed out since the last minor collection
+
+// Parallel evacuation, minor collections split the Managed List between collectionThreads threads
+// each copies into its own buffer (PLAB) claimed from the to-space, so copies need no lock
+#define EVACUATION_CHUNK 512          // Managed List slots a thread claims at a time
+#define PARALLEL_MIN_SLOTS 2048       // shorter Managed Lists are evacuated serially
+#define PARALLEL_MIN_BYTES (1 << 20) // so are young heaps with less in use, starting the threads costs more than it saves
+#define PLAB_BYTES 8192               // to-space claimed at a time, bigger blocks get a claim of their own
+#define MAX_COLLECTION_THREADS 64
+
+typedef struct evacuationWorker
+{
+    pthread_t thread;
+    int heapIndex;                 // the to-space
+    unsigned char *plab;           // next free byte of this thread's buffer
+    unsigned char *plabEnd;
+    memoryBlockHeader *lastCopied; // last block copied into the buffer, it takes slack too small for a block
+    size_t bytesCopied;
+    size_t slack;                  // bytes handed to blocks beyond their size, added to bytesAllocated
+} evacuationWorker;
+
+int collectionThreads = 1;
+atomic_int evacuationNextChunk;
+_Atomic(unsigned char *) evacuationTop; // everything below has been claimed
+pthread_mutex_t promotionLock = PTHREAD_MUTEX_INITIALIZER; // the old heap is shared by all copying threads
+
+// Incremental minor collection, duCollectStep evacuates the young heap a slice at a time
+// the collected heap stops being current when the cycle starts, so copies and new blocks share the to-space
+// Managed() reads the slot each copy rewrites, which is all the barrier a handle needs
+#define STEP_SLOTS 64       // Managed List slots evacuated between clock checks
+int incrementalFrom = -1;  // young heap being evacuated, -1 while no cycle is running
+int incrementalCursor = 0; // next Managed List slot to evacuate
 
 memoryBlockHeader *freeListHeaders[ROWS]; // 1d array of free block headers, 0 for current 1 for new
 memoryBlockHeader *currrentHeader = NULL;
 int currentHeapIndex = 0;
 
+// Bump allocation, each heap starts in this mode after init or a minor collection
+// everything from bumpPointer to the end of the heap is free space with no header yet
+unsigned char *bumpPointer[ROWS]; // NULL once the heap has been sealed into the free list
+// nothing at or above this address in a young heap was written since the pages were mapped or released,
+// so bump allocations from there are already zero
+unsigned char *untouched[ROWS];
+int allocationZeroed; // set by the last young or large allocation when its payload is known to be zero
+
+// Size class bins for SEGREGATED_FIT
+// classes below SMALL_CLASS_LIMIT are 8 bytes wide, the rest cover one power of two each
+#define SMALL_CLASS_LIMIT 256
+#define NUM_SIZE_CLASSES 64
+memoryBlockHeader *segregatedBins[ROWS][NUM_SIZE_CLASSES]; // free blocks of each heap binned by size
+unsigned long long segregatedBinMask[ROWS];                // bit i set when bin i is not empty
+
+// Occupancy bitmaps for BITMAP_FIT, one bit per 8 byte granule of each heap, set while the granule is free
+// free blocks are always coalesced, so every run of set bits is exactly one free block
+unsigned long long *heapBitmap[ROWS]; // reserved like the heaps, mapped as they grow
+size_t bitmapHint[ROWS];              // no free granule in any word before this one
+
+// Fragmentation counters, kept up to date by every free list insert and remove
+int freeBlockCount[ROWS];    // number of free blocks in each heap
+size_t freeByteCount[ROWS]; // bytes of payload held by those blocks
+int coalesceCount = 0;    // number of neighbour merges done by duFree
+
 int allocationStrategy;
 
-void duInitMalloc(int strategy)
+// Statistics kept under the heap lock, the thread caches keep their own and duGetStats adds them up
+duStats stats;
+
+// Per-thread caches of small blocks, only used in THREAD_SAFE mode
+#define CACHE_LIMIT 256                     // largest block size served from a thread cache
+#define CACHE_CLASSES (CACHE_LIMIT / 8 + 1) // one cache bin per 8 bytes
+#define CACHE_BATCH_BYTES 8192              // bytes carved from the shared heap per refill
+#define CACHE_MAX 64                        // cached blocks per bin before half go back to the heap
+#define MAX_THREAD_CACHES 256
+
+typedef struct threadCache
 {
-    allocationStrategy = strategy;
-    // initializing the memory of the heap to 0
-    for (int i = 0; i < ROWS; i++)
+    memoryBlockHeader *bins[CACHE_CLASSES];   // cached blocks by size / 8, only touched by the owning thread
+    int counts[CACHE_CLASSES];                // number of blocks in each bin
+    int epoch;                                // cacheEpoch the bins were filled in
+    atomic_int inUse;                         // claimed by a live thread, frees for an unclaimed cache go to the heap
+    // written only by the owning thread, relaxed atomics so duGetStats can read them at any time
+    _Atomic size_t allocations, bytesAllocated, frees, bytesFreed;
+    _Atomic(memoryBlockHeader *) remoteFrees; // blocks freed by other threads, pushed lock free
+} threadCache;
+
+int threadSafe = 0; // set by or-ing THREAD_SAFE into the strategy
+pthread_mutex_t heapLock = PTHREAD_MUTEX_INITIALIZER;
+threadCache threadCaches[MAX_THREAD_CACHES];
+__thread threadCache *myCache = NULL;
+pthread_key_t cacheKey;
+pthread_once_t cacheKeyOnce = PTHREAD_ONCE_INIT;
+atomic_int cacheEpoch; // bumped whenever the heaps are reset, which empties every cache
+
+// Object pools, slabs taken from the old heap with duMalloc and cut into equal slots
+// a slot has no header, a free one holds the next free slot in its first word
+#define POOL_SLAB_BYTES 16384 // slab size, unless 8 slots need more
+#define POOL_MIN_SLOTS 8
+
+struct duPool
+{
+    size_t slotSize;        // object size rounded up to 8, never smaller than a pointer
+    size_t slabBytes;       // bytes asked of duMalloc per slab
+    void *slabs;            // every slab starts with a pointer to the one allocated before it
+    void *freeSlots;        // slots handed back by duPoolFree
+    unsigned char *carve;   // next never used slot of the newest slab
+    unsigned char *slabEnd; // end of the newest slab
+};
+
+// Tracing, events collect in a ring and are written out whenever it fills
+#define TRACE_RING 4096 // events buffered before a write
+#define TRACE_TOMBSTONE ((void *)1)
+atomic_int tracing;
+pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+FILE *traceFile = NULL;
+struct timespec traceStart;
+duTraceEvent traceRing[TRACE_RING];
+int traceRingCount = 0;
+unsigned int traceNextId = 1;
+// open addressed table from block or handle address to trace id
+void **traceKeys = NULL;
+unsigned int *traceIds = NULL;
+size_t traceCapacity = 0;
+size_t traceUsed = 0; // live keys and tombstones
+
+void lockHeap()
+{
+    if (threadSafe)
     {
-        for (int j = 0; j < COLS; j++)
-        {
-            heap[i][j] = 0;
-        }
+        pthread_mutex_lock(&heapLock);
     }
-    // initializing the entire heap as one large block
-    memoryBlockHeader *currentBlock = (memoryBlockHeader *)heap[currentHeapIndex];
-    currentBlock->size = HEAP_SIZE - sizeof(memoryBlockHeader);
+}
 
-    currentBlock->free = 1; // Initially, the whole heap is free
-    currentBlock->next = NULL;
-    freeListHeaders[currentHeapIndex] = currentBlock;
+void unlockHeap()
+{
+    if (threadSafe)
+    {
+        pthread_mutex_unlock(&heapLock);
+    }
 }
 
-void printMemoryBlock(memoryBlockHeader *block)
+int sizeClass(size_t size)
 {
-    // Print the block
-    printf("%s at %p, size %d\n", (block->free == USED) ? "Used" : "Free", block, block->size);
+    if (size < SMALL_CLASS_LIMIT)
+    {
+        return size / 8;
+    }
+    // one class per power of two above the small classes, the last bin takes everything bigger
+    int log2 = 63 - __builtin_clzll(size);
+    int binIndex = SMALL_CLASS_LIMIT / 8 + log2 - __builtin_ctz(SMALL_CLASS_LIMIT);
+    return binIndex < NUM_SIZE_CLASSES ? binIndex : NUM_SIZE_CLASSES - 1;
 }
 
-void printFreeList(int heapIndex)
+size_t requestSize(size_t size)
 {
-    printf("\n");
-    printf("Free List\n");
-    memoryBlockHeader *currentBlock = (memoryBlockHeader *)heap[heapIndex]; // start from heap free list
-    while (currentBlock != NULL)
+    // Round up to nearest multiple of 8, and to a block that can go on a free list
+    size = (size + 7) & ~(size_t)7;
+    return size > MIN_PAYLOAD ? size : MIN_PAYLOAD;
+}
+
+// Block field access, the only code that knows the header layout
+#ifdef COMPACT_HEADER
+size_t getSize(memoryBlockHeader *block)
+{
+    return block->sizeAndFree & ~(size_t)7;
+}
+
+int isFree(memoryBlockHeader *block)
+{
+    return block->sizeAndFree & FREE;
+}
+
+size_t *blockTag(memoryBlockHeader *block)
+{
+    return (size_t *)((unsigned char *)block + sizeof(memoryBlockHeader) + getSize(block));
+}
+
+// tag bits: 0 used, 1-8 age, 9-17 owning cache + 1, 32-63 managed index + 1
+int getManagedIndex(memoryBlockHeader *block)
+{
+    return (int)(*blockTag(block) >> 32) - 1;
+}
+
+void setManagedIndex(memoryBlockHeader *block, int index)
+{
+    size_t *tag = blockTag(block);
+    *tag = (*tag & 0xffffffff) | (size_t)(unsigned int)(index + 1) << 32;
+}
+
+int getAge(memoryBlockHeader *block)
+{
+    return (*blockTag(block) >> 1) & 0xff;
+}
+
+void setAge(memoryBlockHeader *block, int age)
+{
+    size_t *tag = blockTag(block);
+    *tag = (*tag & ~(size_t)(0xff << 1)) | (size_t)age << 1;
+}
+
+struct threadCache *getOwner(memoryBlockHeader *block)
+{
+    size_t owner = (*blockTag(block) >> 9) & 0x1ff;
+    return owner == 0 ? NULL : &threadCaches[owner - 1];
+}
+
+void setOwner(memoryBlockHeader *block, struct threadCache *owner)
+{
+    size_t *tag = blockTag(block);
+    size_t ownerIndex = owner == NULL ? 0 : owner - threadCaches + 1;
+    *tag = (*tag & ~(size_t)(0x1ff << 9)) | ownerIndex << 9;
+}
+
+memoryBlockHeader *getNext(memoryBlockHeader *block)
+{
+    return ((freeLinks *)(block + 1))->next;
+}
+
+void setNext(memoryBlockHeader *block, memoryBlockHeader *next)
+{
+    ((freeLinks *)(block + 1))->next = next;
+}
+
+memoryBlockHeader *getPrev(memoryBlockHeader *block)
+{
+    return ((freeLinks *)(block + 1))->prev;
+}
+
+void setPrev(memoryBlockHeader *block, memoryBlockHeader *prev)
+{
+    ((freeLinks *)(block + 1))->prev = prev;
+}
+
+void setBlock(memoryBlockHeader *block, size_t size, int free)
+{
+    // write the header and the footer, or a fresh unmanaged tag for a used block
+    block->sizeAndFree = size | free;
+    *blockTag(block) = free ? size : USED_TAG;
+}
+
+memoryBlockHeader *prevFreeBlock(int heapIndex, memoryBlockHeader *block)
+{
+    // the physical predecessor if it is free, a used one is recognised by its tag
+    if ((unsigned char *)block == heap[heapIndex])
+    {
+        return NULL;
+    }
+    size_t footer = *(size_t *)((unsigned char *)block - sizeof(memoryBlockFooter));
+    if (footer & USED_TAG)
     {
-        printf("Block at %p, size %d\n", currentBlock, currentBlock->size);
-        currentBlock = currentBlock->next;
+        return NULL;
     }
+    return (memoryBlockHeader *)((unsigned char *)block - BLOCK_OVERHEAD - footer);
+}
+#else
+size_t getSize(memoryBlockHeader *block)
+{
+    return block->size;
 }
 
-void duManagedInitMalloc(int searchType)
+int isFree(memoryBlockHeader *block)
+{
+    return block->free == FREE;
+}
+
+int getManagedIndex(memoryBlockHeader *block)
+{
+    return block->managedIndex;
+}
+
+void setManagedIndex(memoryBlockHeader *block, int index)
+{
+    block->managedIndex = index;
+}
+
+int getAge(memoryBlockHeader *block)
+{
+    return block->age;
+}
+
+void setAge(memoryBlockHeader *block, int age)
+{
+    block->age = age;
+}
+
+struct threadCache *getOwner(memoryBlockHeader *block)
+{
+    return block->owner;
+}
+
+void setOwner(memoryBlockHeader *block, struct threadCache *owner)
+{
+    block->owner = owner;
+}
+
+memoryBlockHeader *getNext(memoryBlockHeader *block)
+{
+    return block->next;
+}
+
+void setNext(memoryBlockHeader *block, memoryBlockHeader *next)
+{
+    block->next = next;
+}
+
+memoryBlockHeader *getPrev(memoryBlockHeader *block)
 {
-    // Call the original initialization function
-    duInitMalloc(searchType);
-    // Initialize Managed List slots and size
-    for (int i = 0; i < HEAP_SIZE / 8; i++)
+    return block->prev;
+}
+
+void setPrev(memoryBlockHeader *block, memoryBlockHeader *prev)
+{
+    block->prev = prev;
+}
+
+memoryBlockFooter *blockFooter(memoryBlockHeader *block)
+{
+    return (memoryBlockFooter *)((unsigned char *)block + sizeof(memoryBlockHeader) + block->size);
+}
+
+void setBlock(memoryBlockHeader *block, size_t size, int free)
+{
+    // write the header and the matching boundary tag, a used block starts out unmanaged
+    block->size = size;
+    block->free = free;
+    blockFooter(block)->size = size;
+    if (free == USED)
     {
-        managedList[i] = NULL;
+        block->managedIndex = -1;
+        block->age = 0;
+        block->owner = NULL;
     }
-    managedListSize = 0;
 }
 
-void printManagedList()
+memoryBlockHeader *prevFreeBlock(int heapIndex, memoryBlockHeader *block)
 {
-    // should i include a if statement to check if the managedList is empty, do i print nil?
-    printf("\nManagedList\n");
-    for (int i = 0; i < managedListSize; i++)
+    // the physical predecessor if it is free
+    if ((unsigned char *)block == heap[heapIndex])
     {
-        printf("ManagedList[%d] = %p\n", i, managedList[i]);
+        return NULL;
     }
+    memoryBlockFooter *footer = (memoryBlockFooter *)((unsigned char *)block - sizeof(memoryBlockFooter));
+    memoryBlockHeader *prev = (memoryBlockHeader *)((unsigned char *)block - BLOCK_OVERHEAD - footer->size);
+    return prev->free == FREE ? prev : NULL;
 }
+#endif
 
-void duMemoryDump()
+memoryBlockHeader *nextPhysicalBlock(int heapIndex, memoryBlockHeader *block)
 {
-    printf("MEMORY DUMP\n");
-    printf("Current heap (0/1 young):%d\n", currentHeapIndex);
-    printf("Young Heap (only current one)\n");
-    // Print memory block information for all blocks
-    memoryBlockHeader *current = (memoryBlockHeader *)heap[currentHeapIndex];
-    char free = 'a';
-    char used = 'A';
-    char string[HEAP_SIZE / 8 + 1];
+    memoryBlockHeader *next = (memoryBlockHeader *)((unsigned char *)block + BLOCK_OVERHEAD + getSize(block));
+    return (unsigned char *)next < heap[heapIndex] + heapSize[heapIndex] ? next : NULL;
+}
 
-    while (current < (memoryBlockHeader *)(heap[currentHeapIndex] + HEAP_SIZE))
+memoryBlockHeader **freeListHead(int heapIndex, memoryBlockHeader *block)
+{
+    // the list a free block of this size lives on
+    if (allocationStrategy == SEGREGATED_FIT)
     {
-        printMemoryBlock(current);
-        int blockSize = (current->size + sizeof(memoryBlockHeader)) / 8; // Number of characters to represent block
-        int string_i = ((unsigned char *)current - (unsigned char *)heap[currentHeapIndex]) / 8;
-
-        if (current->free == FREE)
-        {
-            for (int i = string_i; i < string_i + blockSize; i++)
-            {
-                string[i] = free;
-            }
-            free++;
-        }
-        else
-        {
-            for (int i = string_i; i < string_i + blockSize; i++)
-            {
-                string[i] = used;
-            }
-            used++;
-        }
-        current = (memoryBlockHeader *)((unsigned char *)current + sizeof(memoryBlockHeader) + (current->size));
+        return &segregatedBins[heapIndex][sizeClass(getSize(block))];
     }
-    string[HEAP_SIZE / 8] = '\0';
-    // Print graphical representation of memory blocks
-    printf("Memory Block\n");
-    printf("%s\n", string);
-    // Print free list
-    printFreeList(currentHeapIndex);
+    return &freeListHeaders[heapIndex];
+}
 
-    printManagedList();
+// Free block index for BEST_FIT, a treap ordered by size then address rooted in freeListHeaders
+// the list links become the child links, next to the smaller side and prev to the larger,
+// and a node's priority is a hash of its address so nothing extra is stored in the block
+unsigned long long treePriority(memoryBlockHeader *block)
+{
+    unsigned long long x = (uintptr_t)block;
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    return x;
 }
 
-void *duMalloc(int size)
+int treeBefore(memoryBlockHeader *a, memoryBlockHeader *b)
 {
-    // Calculate the size of the block to allocate
-    // Round up to nearest multiple of 8
-    int blockSize = (size + 7) & ~7;
-    int totalSize = blockSize + sizeof(memoryBlockHeader);
-    memoryBlockHeader *currentBlock;
-    memoryBlockHeader *prevBlock;
-    if (allocationStrategy == FIRST_FIT)
+    return getSize(a) < getSize(b) || (getSize(a) == getSize(b) && a < b);
+}
+
+void treeSplit(memoryBlockHeader *root, memoryBlockHeader *key, memoryBlockHeader **smaller, memoryBlockHeader **larger)
+{
+    // cut a subtree into the nodes ordered before key and the ones after it
+    if (root == NULL)
     {
-        // Traverse free list to find first block that fits
-        currentBlock = freeListHeaders[currentHeapIndex];
-        prevBlock = NULL;
-        // Find the first block that fits
-        while (currentBlock != NULL && currentBlock->size < totalSize)
-        {
-            prevBlock = currentBlock;
-            currentBlock = currentBlock->next;
-        }
+        *smaller = NULL;
+        *larger = NULL;
     }
-    else if (allocationStrategy == BEST_FIT)
+    else if (treeBefore(root, key))
     {
-        currentBlock = freeListHeaders[currentHeapIndex];
-        prevBlock = NULL;
-        memoryBlockHeader *bestBlock = NULL;
-        memoryBlockHeader *prevBestBlock = NULL;
-        while (currentBlock != NULL)
-        {
-            if (currentBlock->size >= totalSize)
-            {
-                if (bestBlock == NULL || currentBlock->size < bestBlock->size)
-                {
-                    bestBlock = currentBlock;
-                    prevBestBlock = prevBlock;
-                }
-            }
-            prevBlock = currentBlock;
-            currentBlock = currentBlock->next;
-        }
-        currentBlock = bestBlock;
-        prevBlock = prevBestBlock;
+        memoryBlockHeader *rest;
+        treeSplit(getPrev(root), key, &rest, larger);
+        setPrev(root, rest);
+        *smaller = root;
     }
     else
     {
-        printf("Invalid allocation strategy\n");
-        exit(1);
+        memoryBlockHeader *rest;
+        treeSplit(getNext(root), key, smaller, &rest);
+        setNext(root, rest);
+        *larger = root;
     }
-    // If no block found, return NULL
-    if (currentBlock == NULL)
+}
+
+memoryBlockHeader *treeJoin(memoryBlockHeader *smaller, memoryBlockHeader *larger)
+{
+    // join two subtrees where every node of smaller is ordered before every node of larger
+    if (smaller == NULL)
     {
-        return NULL;
+        return larger;
     }
-    // Calculate the address of the new block
-    memoryBlockHeader *newBlock = (memoryBlockHeader *)((unsigned char *)currentBlock + totalSize);
-    newBlock->size = currentBlock->size - totalSize;
-    newBlock->next = currentBlock->next;
-    newBlock->free = FREE;
-    // insert the new block into the free list
-    if (prevBlock == NULL)
+    if (larger == NULL)
     {
-        freeListHeaders[currentHeapIndex] = newBlock;
+        return smaller;
     }
-    else
+    if (treePriority(smaller) > treePriority(larger))
     {
-        prevBlock->next = newBlock;
+        setPrev(smaller, treeJoin(getPrev(smaller), larger));
+        return smaller;
     }
-    // Set the size of the block to return
-    currentBlock->size = blockSize;
-    currentBlock->next = NULL;
-    currentBlock->free = USED;
-    // Return the address of the block
-    return (unsigned char *)currentBlock + sizeof(memoryBlockHeader);
+    setNext(larger, treeJoin(smaller, getNext(larger)));
+    return larger;
 }
 
-void duFree(void *ptr)
+memoryBlockHeader *treeInsert(memoryBlockHeader *root, memoryBlockHeader *block)
 {
-    // Calculate block header pointer
-    memoryBlockHeader *blockHeader = (memoryBlockHeader *)((unsigned char *)ptr - sizeof(memoryBlockHeader));
-    // Traverse free list to find correct location to splice in the block
-    memoryBlockHeader *currentBlock = freeListHeaders[currentHeapIndex];
-    memoryBlockHeader *prevBlock = NULL;
-    // Find the first block that is greater than the block to free
-    while (currentBlock != NULL && currentBlock < blockHeader)
+    // returns the new root of the subtree
+    if (root == NULL || treePriority(block) > treePriority(root))
     {
-        prevBlock = currentBlock;
-        currentBlock = currentBlock->next;
+        memoryBlockHeader *smaller;
+        memoryBlockHeader *larger;
+        treeSplit(root, block, &smaller, &larger);
+        setNext(block, smaller);
+        setPrev(block, larger);
+        return block;
     }
-
-    blockHeader->next = currentBlock;
-    blockHeader->free = FREE;
-    // Splice in the block
-    if (prevBlock == NULL)
+    if (treeBefore(block, root))
     {
-        // Block becomes new head of free list
-        freeListHeaders[currentHeapIndex] = blockHeader;
+        setNext(root, treeInsert(getNext(root), block));
     }
     else
     {
-        prevBlock->next = blockHeader;
+        setPrev(root, treeInsert(getPrev(root), block));
     }
+    return root;
 }
 
-void **duManagedMalloc(int size)
+memoryBlockHeader *treeRemove(memoryBlockHeader *root, memoryBlockHeader *block)
 {
-    // Call the original malloc function
-    void *ptr = duMalloc(size);
-    if (ptr == NULL)
+    // block must be in the subtree, returns the new root of the subtree
+    if (root == block)
     {
-        return NULL; // Allocation failed
+        return treeJoin(getNext(block), getPrev(block));
     }
-    // Add an entry into the Managed List
-    if (managedListSize < HEAP_SIZE / 8)
+    if (treeBefore(block, root))
     {
-        managedList[managedListSize] = ptr;
-        // Set the managed index in the heap block
-        memoryBlockHeader *blockHeader = (memoryBlockHeader *)((unsigned char *)ptr - sizeof(memoryBlockHeader));
-        blockHeader->managedIndex = managedListSize;
-        managedListSize++;
+        setNext(root, treeRemove(getNext(root), block));
     }
     else
     {
-        // Managed List is full, handle error or resize array
-        // For now, just return NULL
-        return NULL;
+        setPrev(root, treeRemove(getPrev(root), block));
     }
-    // Return the pointer to the Managed List slot
-    return &managedList[managedListSize - 1];
+    return root;
 }
 
-void duManagedFree(void **mptr)
+memoryBlockHeader *treeFind(memoryBlockHeader *root, size_t blockSize)
 {
-    // Check if the Managed List slot is NULL
-    if (*mptr == NULL)
+    // the smallest block that fits, the lowest address among equal sizes
+    memoryBlockHeader *best = NULL;
+    while (root != NULL)
     {
-        return; // Pointer has already been freed
+        if (getSize(root) >= blockSize)
+        {
+            best = root;
+            root = getNext(root);
+        }
+        else
+        {
+            root = getPrev(root);
+        }
     }
-    // Call the original free function to remove the block from the heap
-    duFree(*mptr);
-    // Null out the address at the slot in the Managed List
-    *mptr = NULL;
+    return best;
 }
 
-void minorCollection()
+void printTree(memoryBlockHeader *root)
 {
-    for (int i = 0; i < managedListSize; i++)
+    // in order, so smallest first
+    if (root != NULL)
+    {
+        printTree(getNext(root));
+        printf("Block at %p, size %zu\n", root, getSize(root));
+        printTree(getPrev(root));
+    }
+}
+
+void freeListInsert(int heapIndex, memoryBlockHeader *block)
+{
+    freeBlockCount[heapIndex]++;
+    freeByteCount[heapIndex] += getSize(block);
+    if (allocationStrategy == BITMAP_FIT)
+    {
+        return; // the bitmap is the free list
+    }
+    if (allocationStrategy == BEST_FIT)
+    {
+        freeListHeaders[heapIndex] = treeInsert(freeListHeaders[heapIndex], block);
+        return;
+    }
+    // push the block on the front of its list
+    memoryBlockHeader **head = freeListHead(heapIndex, block);
+    setPrev(block, NULL);
+    setNext(block, *head);
+    if (*head != NULL)
+    {
+        setPrev(*head, block);
+    }
+    *head = block;
+    if (allocationStrategy == SEGREGATED_FIT)
     {
-        if (managedList[i] != NULL)
+        segregatedBinMask[heapIndex] |= 1ULL << sizeClass(getSize(block));
+    }
+}
+
+void freeListRemove(int heapIndex, memoryBlockHeader *block)
+{
+    freeBlockCount[heapIndex]--;
+    freeByteCount[heapIndex] -= getSize(block);
+    if (allocationStrategy == BITMAP_FIT)
+    {
+        return;
+    }
+    if (allocationStrategy == BEST_FIT)
+    {
+        freeListHeaders[heapIndex] = treeRemove(freeListHeaders[heapIndex], block);
+        return;
+    }
+    // unlink the block in O(1) through its prev pointer
+    memoryBlockHeader **head = freeListHead(heapIndex, block);
+    if (getPrev(block) == NULL)
+    {
+        *head = getNext(block);
+    }
+    else
+    {
+        setNext(getPrev(block), getNext(block));
+    }
+    if (getNext(block) != NULL)
+    {
+        setPrev(getNext(block), getPrev(block));
+    }
+    if (allocationStrategy == SEGREGATED_FIT && *head == NULL)
+    {
+        segregatedBinMask[heapIndex] &= ~(1ULL << sizeClass(getSize(block)));
+    }
+    setNext(block, NULL);
+    setPrev(block, NULL);
+}
+
+memoryBlockHeader *segregatedFind(int heapIndex, size_t blockSize)
+{
+    int binIndex = sizeClass(blockSize);
+    if (blockSize >= SMALL_CLASS_LIMIT || binIndex == NUM_SIZE_CLASSES - 1)
+    {
+        // a power of two bin can hold blocks smaller than the request, so search it first fit
+        memoryBlockHeader *currentBlock = segregatedBins[heapIndex][binIndex];
+        while (currentBlock != NULL && getSize(currentBlock) < blockSize)
+        {
+            currentBlock = getNext(currentBlock);
+        }
+        if (currentBlock != NULL)
         {
-            memoryBlockHeader *currentBlock = (memoryBlockHeader *)((unsigned char *) managedList[i] - sizeof(memoryBlockHeader));
-            void *pointerToMoveTo = currentBlock;
-            void *pointerToFromFrom = managedList[i];
-            size_t numberOfBytesToMoveTo = currentBlock->size;
-            // if slot is not free/null, the live pointer points to a new address
-            memcpy(pointerToMoveTo, pointerToFromFrom, numberOfBytesToMoveTo);
+            return currentBlock;
         }
+        binIndex++;
+    }
+    // every block in a higher non empty bin fits, so take the head of the first one
+    unsigned long long candidates = binIndex < NUM_SIZE_CLASSES ? segregatedBinMask[heapIndex] & (~0ULL << binIndex) : 0;
+    if (candidates == 0)
+    {
+        return NULL;
     }
+    return segregatedBins[heapIndex][__builtin_ctzll(candidates)];
+}
 
-    // reset the managed list
-    for (int i = 0; i < managedListSize; i++)
+void markGranules(int heapIndex, void *start, size_t bytes, int free)
+{
+    // set or clear the bitmap bits of [start, start + bytes), only BITMAP_FIT keeps them
+    if (allocationStrategy != BITMAP_FIT || bytes == 0)
     {
-        managedList[i] = NULL;
+        return;
     }
-    managedListSize = 0;
-    // reset the free list
-    memoryBlockHeader *currentBlock = freeListHeaders[currentHeapIndex];
-    memoryBlockHeader *prevBlock = NULL;
-    while (currentBlock != NULL)
+    unsigned long long *bits = heapBitmap[heapIndex];
+    size_t first = ((unsigned char *)start - heap[heapIndex]) / 8;
+    size_t last = first + bytes / 8 - 1;
+    size_t firstWord = first / 64;
+    size_t lastWord = last / 64;
+    unsigned long long headMask = ~0ULL << (first % 64);
+    unsigned long long tailMask = ~0ULL >> (63 - last % 64);
+    if (firstWord == lastWord)
     {
-        prevBlock = currentBlock;
-        currentBlock = currentBlock->next;
-    }
-    freeListHeaders[currentHeapIndex] = prevBlock;
-    // swap the heaps
-    currentHeapIndex = (currentHeapIndex + 1) % 2;
-    // reset the free list
-    if (heap[currentHeapIndex] != NULL)
-    {
-        freeListHeaders[currentHeapIndex] = (memoryBlockHeader *)heap[currentHeapIndex];
-        freeListHeaders[currentHeapIndex]->size = HEAP_SIZE - sizeof(memoryBlockHeader);
-        freeListHeaders[currentHeapIndex]->free = 1;
-        freeListHeaders[currentHeapIndex]->next = NULL;
-    }
-}
-
-// void minorCollection() {
-//     // Create a new heap
-//     currentHeapIndex = 1 - currentHeapIndex;
-//     memoryBlockHeader *currentBlock = (memoryBlockHeader *)heap[currentHeapIndex];
-//     currentBlock->size = HEAP_SIZE - sizeof(memoryBlockHeader);
-//     currentBlock->free = 1; // Initially, the whole heap is free
-//     currentBlock->next = NULL;
-//     freeListHeaders[currentHeapIndex] = currentBlock;
-//     // Traverse the old heap and copy live blocks to the new heap
-//     memoryBlockHeader *oldBlock = (memoryBlockHeader *)heap[1 - currentHeapIndex];
-//     memoryBlockHeader *prevBlock = NULL;
-//     while (oldBlock != NULL)
-//     {
-//         if (oldBlock->free == USED)
-//         {
-//             // Copy the block to the new heap
-//             memccpy((unsigned char *)currentBlock + sizeof(memoryBlockHeader), (unsigned char *)oldBlock + sizeof(memoryBlockHeader), 1, oldBlock->size);
-//         }
-//         oldBlock = (memoryBlockHeader *)((unsigned char *)oldBlock + sizeof(memoryBlockHeader) + oldBlock->size);
-//     }
-//     // Free the old heap
-//     freeListHeaders[1 - currentHeapIndex] = NULL;
-//     // Reset the managed list
-//     for (int i = 0; i < HEAP_SIZE / 8; i++)
-//     {
-//         managedList[i] = NULL;
-//     }
-//     managedListSize = 0;
-// }
\ No newline at end of file
+        headMask &= tailMask;
+    }
+    bits[firstWord] = free ? bits[firstWord] | headMask : bits[firstWord] & ~headMask;
+    if (lastWord > firstWord)
+    {
+        memset(&bits[firstWord + 1], free ? 0xff : 0, (lastWord - firstWord - 1) * sizeof(unsigned long long));
+        bits[lastWord] = free ? bits[lastWord] | tailMask : bits[lastWord] & ~tailMask;
+    }
+    if (free && firstWord < bitmapHint[heapIndex])
+    {
+        bitmapHint[heapIndex] = firstWord;
+    }
+}
+
+size_t skipUsedWords(unsigned long long *bits, size_t word, size_t end)
+{
+    // step over words with no free granule, several at a time where the CPU allows
+#if defined(__AVX2__)
+    while (word + 4 <= end)
+    {
+        __m256i v = _mm256_loadu_si256((const __m256i *)(bits + word));
+        if (!_mm256_testz_si256(v, v))
+        {
+            break;
+        }
+        word += 4;
+    }
+#elif defined(__SSE4_1__)
+    while (word + 2 <= end)
+    {
+        __m128i v = _mm_loadu_si128((const __m128i *)(bits + word));
+        if (!_mm_testz_si128(v, v))
+        {
+            break;
+        }
+        word += 2;
+    }
+#endif
+    while (word < end && bits[word] == 0)
+    {
+        word++;
+    }
+    return word;
+}
+
+memoryBlockHeader *bitmapFind(int heapIndex, size_t blockSize)
+{
+    // lowest run of free granules long enough for the block and its overhead, so first fit by address
+    unsigned long long *bits = heapBitmap[heapIndex];
+    size_t needed = (blockSize + BLOCK_OVERHEAD) / 8;
+    size_t end = (heapSize[heapIndex] / 8 + 63) / 64;
+    size_t runStart = 0;
+    size_t runLength = 0;
+    size_t word = skipUsedWords(bits, bitmapHint[heapIndex], end);
+    bitmapHint[heapIndex] = word;
+    while (word < end)
+    {
+        unsigned long long w = bits[word];
+        if (w == ~0ULL)
+        {
+            if (runLength == 0)
+            {
+                runStart = word * 64;
+            }
+            runLength += 64;
+        }
+        else if (w == 0)
+        {
+            runLength = 0;
+            word = skipUsedWords(bits, word + 1, end);
+            continue;
+        }
+        else
+        {
+            // walk the runs inside a mixed word, ctz finds where each one stops
+            int bit = 0;
+            while (bit < 64)
+            {
+                unsigned long long rest = w >> bit;
+                if (rest & 1)
+                {
+                    int ones = ~rest == 0 ? 64 - bit : __builtin_ctzll(~rest);
+                    if (runLength == 0)
+                    {
+                        runStart = word * 64 + bit;
+                    }
+                    runLength += ones;
+                    if (runLength >= needed)
+                    {
+                        return (memoryBlockHeader *)(heap[heapIndex] + runStart * 8);
+                    }
+                    bit += ones;
+                }
+                else
+                {
+                    runLength = 0;
+                    bit += rest == 0 ? 64 - bit : __builtin_ctzll(rest);
+                }
+            }
+        }
+        if (runLength >= needed)
+        {
+            return (memoryBlockHeader *)(heap[heapIndex] + runStart * 8);
+        }
+        word++;
+    }
+    return NULL;
+}
+
+memoryBlockHeader *bitmapFreeBlockFrom(int heapIndex, void *from)
+{
+    // first free block at or after from, for walking the free blocks of a BITMAP_FIT heap
+    unsigned long long *bits = heapBitmap[heapIndex];
+    size_t granule = ((unsigned char *)from - heap[heapIndex]) / 8;
+    size_t end = (heapSize[heapIndex] / 8 + 63) / 64;
+    size_t word = granule / 64;
+    if (word >= end)
+    {
+        return NULL;
+    }
+    unsigned long long w = bits[word] & (~0ULL << (granule % 64));
+    if (w == 0)
+    {
+        word = skipUsedWords(bits, word + 1, end);
+        if (word == end)
+        {
+            return NULL;
+        }
+        w = bits[word];
+    }
+    return (memoryBlockHeader *)(heap[heapIndex] + (word * 64 + __builtin_ctzll(w)) * 8);
+}
+
+void initFreeList(int heapIndex, memoryBlockHeader *block)
+{
+    // make block the only free block of the heap, or leave it with none when block is NULL
+    for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+    {
+        segregatedBins[heapIndex][i] = NULL;
+    }
+    segregatedBinMask[heapIndex] = 0;
+    freeListHeaders[heapIndex] = NULL;
+    freeBlockCount[heapIndex] = 0;
+    freeByteCount[heapIndex] = 0;
+    if (allocationStrategy == BITMAP_FIT)
+    {
+        memset(heapBitmap[heapIndex], 0, (heapSize[heapIndex] / 8 + 63) / 64 * sizeof(unsigned long long));
+        bitmapHint[heapIndex] = 0;
+    }
+    if (block != NULL)
+    {
+        freeListInsert(heapIndex, block);
+        markGranules(heapIndex, block, getSize(block) + BLOCK_OVERHEAD, FREE);
+    }
+}
+
+void sealBumpSpace(int heapIndex)
+{
+    // leave bump mode, turning the space after the last bumped block into an ordinary free block
+    unsigned char *start = bumpPointer[heapIndex];
+    size_t remaining = heap[heapIndex] + heapSize[heapIndex] - start;
+    bumpPointer[heapIndex] = NULL;
+    // the bump space is never left smaller than a block, the last bumped block takes any slack
+    if (remaining > 0)
+    {
+        memoryBlockHeader *freeTail = (memoryBlockHeader *)start;
+        setBlock(freeTail, remaining - BLOCK_OVERHEAD, FREE);
+        freeListInsert(heapIndex, freeTail);
+        markGranules(heapIndex, freeTail, remaining, FREE);
+    }
+}
+
+void freeBlock(int heapIndex, memoryBlockHeader *blockHeader)
+{
+    // the first free fragments the heap, so bump allocation stops
+    if (bumpPointer[heapIndex] != NULL)
+    {
+        sealBumpSpace(heapIndex);
+    }
+    // Merge with the physical neighbours through the boundary tags, no list walk needed
+    size_t size = getSize(blockHeader);
+    markGranules(heapIndex, blockHeader, size + BLOCK_OVERHEAD, FREE); // the neighbours' bits are set already
+    memoryBlockHeader *nextBlock = nextPhysicalBlock(heapIndex, blockHeader);
+    if (nextBlock != NULL && isFree(nextBlock))
+    {
+        freeListRemove(heapIndex, nextBlock);
+        size += BLOCK_OVERHEAD + getSize(nextBlock);
+        coalesceCount++;
+    }
+    memoryBlockHeader *prevBlock = prevFreeBlock(heapIndex, blockHeader);
+    if (prevBlock != NULL)
+    {
+        freeListRemove(heapIndex, prevBlock);
+        size += BLOCK_OVERHEAD + getSize(prevBlock);
+        blockHeader = prevBlock;
+        coalesceCount++;
+    }
+    setBlock(blockHeader, size, FREE);
+    freeListInsert(heapIndex, blockHeader);
+}
+
+unsigned char *reserveRegion(size_t bytes)
+{
+    // reserve address space only, pages are mapped in as the region grows
+    void *region = mmap(NULL, bytes, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (region == MAP_FAILED)
+    {
+        printf("Unable to reserve %zu bytes of address space\n", bytes);
+        exit(1);
+    }
+    return region;
+}
+
+int mapRegion(unsigned char *region, size_t from, size_t to)
+{
+    // back [from, to) of a reserved region with fresh zeroed pages
+    if (to <= from)
+    {
+        return 1;
+    }
+    void *chunk = mmap(region + from, to - from, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+    return chunk != MAP_FAILED;
+}
+
+size_t roundToPage(size_t bytes)
+{
+    return (bytes + HEAP_PAGE - 1) & ~(size_t)(HEAP_PAGE - 1);
+}
+
+int heapIndexOf(void *ptr)
+{
+    // which heap a block lives in, -1 if none
+    for (int i = 0; i < ROWS; i++)
+    {
+        if ((unsigned char *)ptr >= heap[i] && (unsigned char *)ptr < heap[i] + heapSize[i])
+        {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int isLargeObject(memoryBlockHeader *block)
+{
+    // large objects live in mappings of their own, outside every heap
+    return heapIndexOf(block) < 0;
+}
+
+unsigned char *largeMapping(memoryBlockHeader *block, size_t *length)
+{
+    // the block fills its mapping, which starts on the page the header is on
+    unsigned char *mapping = (unsigned char *)((uintptr_t)block & ~(uintptr_t)(HEAP_PAGE - 1));
+    *length = (unsigned char *)block - mapping + BLOCK_OVERHEAD + getSize(block);
+    return mapping;
+}
+
+void releaseHeaps()
+{
+    // the Managed List is the only record of the large objects
+    for (int i = 0; i < managedListSize; i++)
+    {
+        if (!SLOT_IN_USE(managedList[i]))
+        {
+            continue;
+        }
+        memoryBlockHeader *block = (memoryBlockHeader *)((unsigned char *)managedList[i] - sizeof(memoryBlockHeader));
+        if (isLargeObject(block))
+        {
+            size_t length;
+            unsigned char *mapping = largeMapping(block, &length);
+            munmap(mapping, length);
+        }
+    }
+    for (int i = 0; i < ROWS; i++)
+    {
+        if (heap[i] != NULL)
+        {
+            munmap(heap[i], heapReserve);
+            munmap(heapBitmap[i], heapReserve / 64);
+            heap[i] = NULL;
+            heapBitmap[i] = NULL;
+        }
+    }
+    if (managedList != NULL)
+    {
+        munmap(managedList, heapReserve);
+        munmap(managedGenerations, heapReserve / 2);
+        munmap(managedNextFree, heapReserve / 2);
+        munmap(managedTypes, heapReserve);
+        munmap(managedMarks, heapReserve / 8);
+        munmap(markStack, heapReserve / 2);
+        munmap(managedAlignments, heapReserve / 8);
+        managedList = NULL;
+        managedGenerations = NULL;
+        managedNextFree = NULL;
+        managedTypes = NULL;
+        managedMarks = NULL;
+        markStack = NULL;
+        managedAlignments = NULL;
+    }
+    free(loadedTypes);
+    loadedTypes = NULL;
+    typedBlockCount = 0;
+    managedListSize = 0;
+    managedListCapacity = 0;
+    managedFreeSlot = -1;
+}
+
+void resetThreadCaches()
+{
+    // cached blocks are dropped whenever the heaps are reset
+    atomic_fetch_add(&cacheEpoch, 1);
+    for (int i = 0; i < MAX_THREAD_CACHES; i++)
+    {
+        atomic_store(&threadCaches[i].remoteFrees, NULL);
+        // cache allocations are counted under the strategy in use, so fold them in before it changes
+        stats.allocations[allocationStrategy] += atomic_exchange(&threadCaches[i].allocations, 0);
+        atomic_store(&threadCaches[i].bytesAllocated, 0);
+        atomic_store(&threadCaches[i].frees, 0);
+        atomic_store(&threadCaches[i].bytesFreed, 0);
+    }
+}
+
+void addCount(_Atomic size_t *counter, size_t amount)
+{
+    // single writer, so a plain load and store is enough and costs no more than a normal add
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + amount, memory_order_relaxed);
+}
+
+double microsSince(struct timespec *start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1e6 + (now.tv_nsec - start->tv_nsec) / 1e3;
+}
+
+void recordCollection(struct timespec *start, size_t bytesCopied)
+{
+    double pause = microsSince(start);
+    stats.lastBytesCopied = bytesCopied;
+    stats.totalBytesCopied += bytesCopied;
+    stats.lastPauseMicros = pause;
+    stats.totalPauseMicros += pause;
+    if (pause > stats.maxPauseMicros)
+    {
+        stats.maxPauseMicros = pause;
+    }
+}
+
+void traceFlush()
+{
+    fwrite(traceRing, sizeof(duTraceEvent), traceRingCount, traceFile);
+    fflush(traceFile);
+    traceRingCount = 0;
+}
+
+duTraceEvent *traceEvent(int op)
+{
+    // trace lock held, the caller fills in the rest of the event
+    if (traceRingCount == TRACE_RING)
+    {
+        traceFlush();
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    duTraceEvent *event = &traceRing[traceRingCount++];
+    event->time = (now.tv_sec - traceStart.tv_sec) * 1000000000ULL + now.tv_nsec - traceStart.tv_nsec;
+    event->op = op;
+    return event;
+}
+
+void traceRecord(int op, unsigned int id, size_t size)
+{
+    // trace lock held
+    duTraceEvent *event = traceEvent(op);
+    event->id = id;
+    event->size = size > 0xffffffff ? 0xffffffff : size;
+}
+
+size_t traceSlot(void *key)
+{
+    // the key's slot, or the first free one on its probe sequence
+    size_t mask = traceCapacity - 1;
+    size_t slot = ((uintptr_t)key >> 3) * 0x9e3779b97f4a7c15ULL & mask;
+    size_t tombstone = traceCapacity;
+    while (traceKeys[slot] != NULL && traceKeys[slot] != key)
+    {
+        if (traceKeys[slot] == TRACE_TOMBSTONE && tombstone == traceCapacity)
+        {
+            tombstone = slot;
+        }
+        slot = (slot + 1) & mask;
+    }
+    return traceKeys[slot] == NULL && tombstone != traceCapacity ? tombstone : slot;
+}
+
+void traceResetIds(size_t capacity)
+{
+    // empty the table, keeping the live keys when it is being grown
+    void **oldKeys = traceKeys;
+    unsigned int *oldIds = traceIds;
+    size_t oldCapacity = traceCapacity;
+    traceKeys = calloc(capacity, sizeof(void *));
+    traceIds = calloc(capacity, sizeof(unsigned int));
+    if (traceKeys == NULL || traceIds == NULL)
+    {
+        printf("Unable to grow the trace table\n");
+        exit(1);
+    }
+    traceCapacity = capacity;
+    traceUsed = 0;
+    for (size_t i = 0; oldKeys != NULL && capacity > oldCapacity && i < oldCapacity; i++)
+    {
+        if (oldKeys[i] != NULL && oldKeys[i] != TRACE_TOMBSTONE)
+        {
+            size_t slot = traceSlot(oldKeys[i]);
+            traceKeys[slot] = oldKeys[i];
+            traceIds[slot] = oldIds[i];
+            traceUsed++;
+        }
+    }
+    free(oldKeys);
+    free(oldIds);
+}
+
+void traceHeapReset(int strategy, size_t size)
+{
+    // trace lock held, every block is gone so every id is forgotten
+    traceResetIds(1024);
+    duTraceEvent *event = traceEvent(DU_TRACE_INIT);
+    event->strategy = strategy;
+    event->heapSize = size;
+}
+
+void traceAllocation(int op, void *key, int size, size_t align)
+{
+    pthread_mutex_lock(&traceLock);
+    if (traceFile == NULL)
+    {
+        pthread_mutex_unlock(&traceLock);
+        return;
+    }
+    if (align > DEFAULT_ALIGNMENT)
+    {
+        traceRecord(DU_TRACE_ALIGN, 0, align);
+    }
+    if (key == NULL)
+    {
+        // write failures out straight away, the program may be about to die of them
+        traceRecord(op, 0, size);
+        traceFlush();
+        pthread_mutex_unlock(&traceLock);
+        return;
+    }
+    if (traceUsed * 2 >= traceCapacity)
+    {
+        traceResetIds(traceCapacity * 2);
+    }
+    size_t slot = traceSlot(key);
+    if (traceKeys[slot] == NULL)
+    {
+        traceUsed++;
+    }
+    traceKeys[slot] = key;
+    traceIds[slot] = traceNextId;
+    traceRecord(op, traceNextId++, size);
+    pthread_mutex_unlock(&traceLock);
+}
+
+void traceRelease(int op, void *key)
+{
+    // recorded before the block is freed, so its address cannot be handed out again first
+    pthread_mutex_lock(&traceLock);
+    if (traceFile != NULL)
+    {
+        size_t slot = traceSlot(key);
+        if (traceKeys[slot] == key)
+        {
+            // blocks allocated before tracing started are not in the trace
+            traceKeys[slot] = TRACE_TOMBSTONE;
+            traceRecord(op, traceIds[slot], 0);
+        }
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+void traceResize(int op, void *oldKey, void *newKey, int size)
+{
+    // the block keeps its id when it moves, newKey is NULL when the resize failed
+    pthread_mutex_lock(&traceLock);
+    if (traceFile != NULL)
+    {
+        if (traceUsed * 2 >= traceCapacity)
+        {
+            traceResetIds(traceCapacity * 2);
+        }
+        size_t slot = traceSlot(oldKey);
+        if (traceKeys[slot] == oldKey)
+        {
+            unsigned int id = traceIds[slot];
+            if (newKey != NULL && newKey != oldKey)
+            {
+                traceKeys[slot] = TRACE_TOMBSTONE;
+                slot = traceSlot(newKey);
+                if (traceKeys[slot] == NULL)
+                {
+                    traceUsed++;
+                }
+                traceKeys[slot] = newKey;
+                traceIds[slot] = id;
+            }
+            traceRecord(op, id, size);
+        }
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+void traceCall(int op, unsigned int id, size_t size)
+{
+    pthread_mutex_lock(&traceLock);
+    if (traceFile != NULL)
+    {
+        traceRecord(op, id, size);
+    }
+    pthread_mutex_unlock(&traceLock);
+}
+
+int duTraceStart(const char *path)
+{
+    duTraceStop();
+    pthread_mutex_lock(&traceLock);
+    traceFile = fopen(path, "wb");
+    if (traceFile == NULL)
+    {
+        pthread_mutex_unlock(&traceLock);
+        return 0;
+    }
+    fwrite(DU_TRACE_MAGIC, 1, 8, traceFile);
+    clock_gettime(CLOCK_MONOTONIC, &traceStart);
+    traceNextId = 1;
+    // start from the heap as it is now, blocks already allocated are left out
+    traceHeapReset(allocationStrategy | (threadSafe ? THREAD_SAFE : 0), initSize);
+    atomic_store(&tracing, 1);
+    pthread_mutex_unlock(&traceLock);
+    return 1;
+}
+
+void duTraceStop()
+{
+    pthread_mutex_lock(&traceLock);
+    atomic_store(&tracing, 0);
+    if (traceFile != NULL)
+    {
+        traceFlush();
+        fclose(traceFile);
+        traceFile = NULL;
+    }
+    free(traceKeys);
+    free(traceIds);
+    traceKeys = NULL;
+    traceIds = NULL;
+    traceCapacity = 0;
+    pthread_mutex_unlock(&traceLock);
+}
+
+void duInitMallocSize(int strategy, size_t size)
+{
+    resetThreadCaches();
+    allocationStrategy = strategy & ~THREAD_SAFE;
+    threadSafe = (strategy & THREAD_SAFE) != 0;
+    if (allocationStrategy < FIRST_FIT || allocationStrategy > BITMAP_FIT)
+    {
+        printf("Invalid allocation strategy\n");
+        exit(1);
+    }
+    size_t allocations[sizeof(stats.allocations) / sizeof(size_t)];
+    memcpy(allocations, stats.allocations, sizeof(allocations));
+    memset(&stats, 0, sizeof(stats));
+    memcpy(stats.allocations, allocations, sizeof(allocations));
+    releaseHeaps();
+    // fresh anonymous mappings start out zeroed, so nothing needs clearing
+    size = (size + 7) & ~(size_t)7;
+    if (size < MIN_BLOCK)
+    {
+        size = MIN_BLOCK;
+    }
+    initSize = size;
+    heapReserve = roundToPage(size) > HEAP_RESERVE / 2 ? roundToPage(size * 2) : HEAP_RESERVE;
+    // the old heap starts out the same size as each young heap
+    for (int i = 0; i < ROWS; i++)
+    {
+        heapSize[i] = size;
+        heapMapped[i] = roundToPage(size);
+        heap[i] = reserveRegion(heapReserve);
+        heapBitmap[i] = (unsigned long long *)reserveRegion(heapReserve / 64);
+        if (!mapRegion(heap[i], 0, heapMapped[i]) || !mapRegion((unsigned char *)heapBitmap[i], 0, roundToPage(heapMapped[i] / 64)))
+        {
+            printf("Unable to map a %zu byte heap\n", size);
+            exit(1);
+        }
+    }
+    // the managed list never needs more than one slot per 8 bytes of heap
+    managedList = (void **)reserveRegion(heapReserve);
+    managedGenerations = (unsigned int *)reserveRegion(heapReserve / 2);
+    managedNextFree = (int *)reserveRegion(heapReserve / 2);
+    managedTypes = (const duType **)reserveRegion(heapReserve);
+    managedMarks = reserveRegion(heapReserve / 8);
+    markStack = (int *)reserveRegion(heapReserve / 2);
+    managedAlignments = reserveRegion(heapReserve / 8);
+    currentHeapIndex = 0;
+    incrementalFrom = -1;
+    coalesceCount = 0;
+    untouched[0] = heap[0];
+    untouched[1] = heap[1];
+    // Initially, the whole young heap is free and handed out by bumping
+    initFreeList(currentHeapIndex, NULL);
+    bumpPointer[currentHeapIndex] = heap[currentHeapIndex];
+    bumpPointer[1 - currentHeapIndex] = NULL;
+    // the old heap is one free block managed by the allocation strategy
+    memoryBlockHeader *oldBlock = (memoryBlockHeader *)heap[OLD_HEAP];
+    setBlock(oldBlock, size - BLOCK_OVERHEAD, FREE);
+    initFreeList(OLD_HEAP, oldBlock);
+    bumpPointer[OLD_HEAP] = NULL;
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        pthread_mutex_lock(&traceLock);
+        traceHeapReset(strategy, size);
+        pthread_mutex_unlock(&traceLock);
+    }
+}
+
+void duInitMalloc(int strategy)
+{
+    duInitMallocSize(strategy, HEAP_SIZE);
+}
+
+void duSetCollectionPolicy(double occupancy, size_t allocationBudget)
+{
+    lockHeap();
+    collectionOccupancy = occupancy;
+    collectionBudget = allocationBudget;
+    unlockHeap();
+}
+
+void pushRoot(void ***root)
+{
+    // heap lock held
+    if (rootCount == rootCapacity)
+    {
+        int newCapacity = rootCapacity == 0 ? 64 : rootCapacity * 2;
+        void ****newRoots = realloc(roots, newCapacity * sizeof(void ***));
+        if (newRoots == NULL)
+        {
+            printf("Unable to register a root\n");
+            exit(1);
+        }
+        roots = newRoots;
+        rootCapacity = newCapacity;
+    }
+    roots[rootCount++] = root;
+}
+
+void popRoot(void ***root)
+{
+    // heap lock held
+    for (int i = 0; i < rootCount; i++)
+    {
+        if (roots[i] == root)
+        {
+            roots[i] = roots[--rootCount];
+            break;
+        }
+    }
+}
+
+void duAddRoot(void ***root)
+{
+    lockHeap();
+    pushRoot(root);
+    unlockHeap();
+}
+
+void duRemoveRoot(void ***root)
+{
+    lockHeap();
+    popRoot(root);
+    unlockHeap();
+}
+
+void duSetCollectionThreads(int threads)
+{
+    lockHeap();
+    collectionThreads = threads < 1 ? 1 : threads > MAX_COLLECTION_THREADS ? MAX_COLLECTION_THREADS : threads;
+    unlockHeap();
+}
+
+void duSetLargeObjectThreshold(size_t bytes)
+{
+    lockHeap();
+    largeObjectThreshold = bytes;
+    unlockHeap();
+}
+
+void duSetPromotionAge(int age)
+{
+    lockHeap();
+    promotionAge = age;
+    unlockHeap();
+}
+
+int growHeap(int heapIndex, size_t needed)
+{
+    // grow a heap by mapping the next chunk of its reservation, at least doubling it
+    // the two young heaps grow together so either can hold the other's survivors
+    size_t size = heapSize[heapIndex];
+    size_t newSize = size + (needed > size ? needed : size);
+    if (newSize > heapReserve)
+    {
+        newSize = size + needed;
+        if (newSize > heapReserve)
+        {
+            return 0;
+        }
+    }
+    size_t newMapped = roundToPage(newSize);
+    int first = heapIndex == OLD_HEAP ? OLD_HEAP : 0;
+    int last = heapIndex == OLD_HEAP ? OLD_HEAP : 1;
+    for (int i = first; i <= last; i++)
+    {
+        if (!mapRegion(heap[i], heapMapped[i], newMapped) ||
+            !mapRegion((unsigned char *)heapBitmap[i], roundToPage(heapMapped[i] / 64), roundToPage(newMapped / 64)))
+        {
+            return 0;
+        }
+    }
+    for (int i = first; i <= last; i++)
+    {
+        heapMapped[i] = newMapped;
+        heapSize[i] = newSize;
+    }
+    if (bumpPointer[heapIndex] != NULL)
+    {
+        // the bump space simply runs further
+        return 1;
+    }
+    // the new space becomes a used block that is freed, so it merges with a free tail
+    memoryBlockHeader *newBlock = (memoryBlockHeader *)(heap[heapIndex] + size);
+    setBlock(newBlock, newSize - size - BLOCK_OVERHEAD, USED);
+    int merges = coalesceCount; // not a merge the program caused
+    freeBlock(heapIndex, newBlock);
+    coalesceCount = merges;
+    return 1;
+}
+
+int duFreeBlockCount()
+{
+    lockHeap();
+    int count = freeBlockCount[currentHeapIndex] + (bumpPointer[currentHeapIndex] != NULL) + freeBlockCount[OLD_HEAP];
+    unlockHeap();
+    return count;
+}
+
+size_t youngFreeBytes()
+{
+    unsigned char *bump = bumpPointer[currentHeapIndex];
+    return bump != NULL ? (size_t)(heap[currentHeapIndex] + heapSize[currentHeapIndex] - bump) : freeByteCount[currentHeapIndex];
+}
+
+int overCollectionOccupancy()
+{
+    // the young heap is at least as full as the collection policy allows
+    return collectionOccupancy > 0 && heapSize[currentHeapIndex] - youngFreeBytes() >= collectionOccupancy * heapSize[currentHeapIndex];
+}
+
+size_t largestFreeBlock(int heapIndex)
+{
+    size_t largest = 0;
+    memoryBlockHeader *block = freeListHeaders[heapIndex];
+    if (allocationStrategy == SEGREGATED_FIT)
+    {
+        // the highest non-empty bin holds the largest blocks
+        block = segregatedBinMask[heapIndex] ? segregatedBins[heapIndex][63 - __builtin_clzll(segregatedBinMask[heapIndex])] : NULL;
+    }
+    if (allocationStrategy == BITMAP_FIT)
+    {
+        block = bitmapFreeBlockFrom(heapIndex, heap[heapIndex]);
+    }
+    if (allocationStrategy == BEST_FIT)
+    {
+        // the rightmost node of the tree is the largest
+        while (block != NULL && getPrev(block) != NULL)
+        {
+            block = getPrev(block);
+        }
+        largest = block != NULL ? getSize(block) : 0;
+        block = NULL;
+    }
+    while (block != NULL)
+    {
+        if (getSize(block) > largest)
+        {
+            largest = getSize(block);
+        }
+        block = allocationStrategy == BITMAP_FIT ? bitmapFreeBlockFrom(heapIndex, (unsigned char *)block + BLOCK_OVERHEAD + getSize(block)) : getNext(block);
+    }
+    unsigned char *bump = bumpPointer[heapIndex];
+    if (bump != NULL && (size_t)(heap[heapIndex] + heapSize[heapIndex] - bump) >= BLOCK_OVERHEAD)
+    {
+        size_t bumpFree = heap[heapIndex] + heapSize[heapIndex] - bump - BLOCK_OVERHEAD;
+        largest = bumpFree > largest ? bumpFree : largest;
+    }
+    return largest;
+}
+
+duStats duGetStats()
+{
+    lockHeap();
+    duStats result = stats;
+    for (int i = 0; i < MAX_THREAD_CACHES; i++)
+    {
+        threadCache *cache = &threadCaches[i];
+        result.allocations[allocationStrategy] += atomic_load_explicit(&cache->allocations, memory_order_relaxed);
+        result.bytesAllocated += atomic_load_explicit(&cache->bytesAllocated, memory_order_relaxed);
+        result.frees += atomic_load_explicit(&cache->frees, memory_order_relaxed);
+        result.bytesFreed += atomic_load_explicit(&cache->bytesFreed, memory_order_relaxed);
+    }
+    result.liveBytes = result.bytesAllocated - result.bytesFreed;
+    result.freeBlocks = freeBlockCount[currentHeapIndex] + (bumpPointer[currentHeapIndex] != NULL) + freeBlockCount[OLD_HEAP];
+    result.freeBytes = youngFreeBytes() + freeByteCount[OLD_HEAP];
+    size_t youngLargest = largestFreeBlock(currentHeapIndex);
+    size_t oldLargest = largestFreeBlock(OLD_HEAP);
+    result.largestFreeBlock = youngLargest > oldLargest ? youngLargest : oldLargest;
+    unlockHeap();
+    return result;
+}
+
+void printMemoryBlock(memoryBlockHeader *block)
+{
+    // Print the block
+    printf("%s at %p, size %zu\n", isFree(block) ? "Free" : "Used", block, getSize(block));
+}
+
+void printFreeList(int heapIndex)
+{
+    printf("\n");
+    printf("Free List\n");
+    if (bumpPointer[heapIndex] != NULL)
+    {
+        printf("Bump space at %p, %zu bytes\n", bumpPointer[heapIndex], (size_t)(heap[heapIndex] + heapSize[heapIndex] - bumpPointer[heapIndex]));
+    }
+    if (allocationStrategy == SEGREGATED_FIT)
+    {
+        for (int i = 0; i < NUM_SIZE_CLASSES; i++)
+        {
+            for (memoryBlockHeader *currentBlock = segregatedBins[heapIndex][i]; currentBlock != NULL; currentBlock = getNext(currentBlock))
+            {
+                printf("Block at %p, size %zu (bin %d)\n", currentBlock, getSize(currentBlock), i);
+            }
+        }
+        return;
+    }
+    if (allocationStrategy == BITMAP_FIT)
+    {
+        memoryBlockHeader *currentBlock = bitmapFreeBlockFrom(heapIndex, heap[heapIndex]);
+        while (currentBlock != NULL)
+        {
+            printf("Block at %p, size %zu\n", currentBlock, getSize(currentBlock));
+            currentBlock = bitmapFreeBlockFrom(heapIndex, (unsigned char *)currentBlock + BLOCK_OVERHEAD + getSize(currentBlock));
+        }
+        return;
+    }
+    if (allocationStrategy == BEST_FIT)
+    {
+        printTree(freeListHeaders[heapIndex]);
+        return;
+    }
+    memoryBlockHeader *currentBlock = freeListHeaders[heapIndex]; // start from heap free list
+    while (currentBlock != NULL)
+    {
+        printf("Block at %p, size %zu\n", currentBlock, getSize(currentBlock));
+        currentBlock = getNext(currentBlock);
+    }
+}
+
+void duManagedInitMallocSize(int searchType, size_t size)
+{
+    // Call the original initialization function, it also resets the Managed List
+    duInitMallocSize(searchType, size);
+}
+
+void duManagedInitMalloc(int searchType)
+{
+    duManagedInitMallocSize(searchType, HEAP_SIZE);
+}
+
+int growManagedList()
+{
+    // map more slots at the end of the reserved list, at least doubling it
+    size_t slotsPerPage = HEAP_PAGE / sizeof(void *);
+    size_t newCapacity = managedListCapacity == 0 ? slotsPerPage : (size_t)managedListCapacity * 2;
+    if (newCapacity * sizeof(void *) > heapReserve || newCapacity > 0x7fffffff)
+    {
+        return 0;
+    }
+    if (!mapRegion((unsigned char *)managedList, managedListCapacity * sizeof(void *), newCapacity * sizeof(void *)) ||
+        !mapRegion((unsigned char *)managedGenerations, roundToPage(managedListCapacity * sizeof(unsigned int)),
+                   roundToPage(newCapacity * sizeof(unsigned int))) ||
+        !mapRegion((unsigned char *)managedNextFree, roundToPage(managedListCapacity * sizeof(int)), roundToPage(newCapacity * sizeof(int))) ||
+        !mapRegion((unsigned char *)managedTypes, managedListCapacity * sizeof(void *), newCapacity * sizeof(void *)) ||
+        !mapRegion(managedMarks, roundToPage(managedListCapacity), roundToPage(newCapacity)) ||
+        !mapRegion(managedAlignments, roundToPage(managedListCapacity), roundToPage(newCapacity)) ||
+        !mapRegion((unsigned char *)markStack, roundToPage(managedListCapacity * sizeof(int)), roundToPage(newCapacity * sizeof(int))))
+    {
+        return 0;
+    }
+    managedListCapacity = newCapacity;
+    return 1;
+}
+
+void printManagedList()
+{
+    // should i include a if statement to check if the managedList is empty, do i print nil?
+    printf("\nManagedList\n");
+    for (int i = 0; i < managedListSize; i++)
+    {
+        printf("ManagedList[%d] = %p\n", i, managedList[i]);
+    }
+}
+
+void printHeap(int heapIndex)
+{
+    // Print memory block information for all blocks
+    memoryBlockHeader *current = (memoryBlockHeader *)heap[heapIndex];
+    char freeLetter = 'a';
+    char usedLetter = 'A';
+    size_t mapLength = heapSize[heapIndex] / 8;
+    char *string = mapLength <= MAX_DUMP_MAP ? malloc(mapLength + 1) : NULL;
+
+    unsigned char *bump = bumpPointer[heapIndex];
+    unsigned char *end = bump != NULL ? bump : heap[heapIndex] + heapSize[heapIndex];
+    while ((unsigned char *)current < end)
+    {
+        printMemoryBlock(current);
+        size_t blockSize = (getSize(current) + BLOCK_OVERHEAD) / 8; // Number of characters to represent block
+        size_t string_i = ((unsigned char *)current - (unsigned char *)heap[heapIndex]) / 8;
+
+        if (string == NULL || allocationStrategy == BITMAP_FIT)
+        {
+            // heap too large to draw, or drawn from the bitmap below
+        }
+        else if (isFree(current))
+        {
+            for (size_t i = string_i; i < string_i + blockSize; i++)
+            {
+                string[i] = freeLetter;
+            }
+            freeLetter++;
+        }
+        else
+        {
+            for (size_t i = string_i; i < string_i + blockSize; i++)
+            {
+                string[i] = usedLetter;
+            }
+            usedLetter++;
+        }
+        current = (memoryBlockHeader *)((unsigned char *)current + BLOCK_OVERHEAD + (getSize(current)));
+    }
+    if (string != NULL && allocationStrategy == BITMAP_FIT)
+    {
+        // one letter per run of granules, so neighbouring used blocks share a letter
+        size_t granules = (end - heap[heapIndex]) / 8;
+        int previous = -1;
+        for (size_t i = 0; i < granules; i++)
+        {
+            int granuleFree = (heapBitmap[heapIndex][i / 64] >> (i % 64)) & 1;
+            if (previous != -1 && granuleFree != previous)
+            {
+                previous ? freeLetter++ : usedLetter++;
+            }
+            string[i] = granuleFree ? freeLetter : usedLetter;
+            previous = granuleFree;
+        }
+        if (previous != -1)
+        {
+            previous ? freeLetter++ : usedLetter++;
+        }
+    }
+    if (bump != NULL)
+    {
+        // the bump space has no header yet, draw it as one free block
+        printf("Bump space at %p, %zu bytes\n", bump, (size_t)(heap[heapIndex] + heapSize[heapIndex] - bump));
+        for (size_t i = (bump - heap[heapIndex]) / 8; string != NULL && i < mapLength; i++)
+        {
+            string[i] = freeLetter;
+        }
+    }
+    // Print graphical representation of memory blocks
+    printf("Memory Block\n");
+    if (string != NULL)
+    {
+        string[mapLength] = '\0';
+        printf("%s\n", string);
+        free(string);
+    }
+    else
+    {
+        printf("(%zu bytes, too large to draw)\n", heapSize[heapIndex]);
+    }
+    // Print free list
+    printFreeList(heapIndex);
+    printf("Fragments: %d free blocks holding %zu bytes\n", freeBlockCount[heapIndex], freeByteCount[heapIndex]);
+}
+
+void duMemoryDump()
+{
+    lockHeap();
+    printf("MEMORY DUMP\n");
+    printf("Current heap (0/1 young):%d\n", currentHeapIndex);
+    printf("Young Heap (only current one)\n");
+    printHeap(currentHeapIndex);
+    printf("\nOld Heap\n");
+    printHeap(OLD_HEAP);
+    printf("%d merges\n", coalesceCount);
+
+    printManagedList();
+    unlockHeap();
+}
+
+memoryBlockHeader *findFreeBlock(int heapIndex, size_t blockSize)
+{
+    // search the heap's free list with the configured strategy
+    memoryBlockHeader *currentBlock;
+    if (allocationStrategy == FIRST_FIT)
+    {
+        // Traverse free list to find first block that fits
+        currentBlock = freeListHeaders[heapIndex];
+        // Find the first block that fits
+        while (currentBlock != NULL && getSize(currentBlock) < blockSize)
+        {
+            currentBlock = getNext(currentBlock);
+        }
+    }
+    else if (allocationStrategy == BEST_FIT)
+    {
+        // O(log n) down the size ordered tree
+        currentBlock = treeFind(freeListHeaders[heapIndex], blockSize);
+    }
+    else if (allocationStrategy == SEGREGATED_FIT)
+    {
+        // O(1) for small sizes
+        currentBlock = segregatedFind(heapIndex, blockSize);
+    }
+    else if (allocationStrategy == BITMAP_FIT)
+    {
+        // word at a time over the occupancy bitmap, no block headers touched
+        currentBlock = bitmapFind(heapIndex, blockSize);
+    }
+    else
+    {
+        printf("Invalid allocation strategy\n");
+        exit(1);
+    }
+    return currentBlock;
+}
+
+void *takeFreeBlock(int heapIndex, memoryBlockHeader *currentBlock, size_t blockSize)
+{
+    freeListRemove(heapIndex, currentBlock);
+    // Split off the rest of the block when it is big enough to carry its own header and footer
+    if (getSize(currentBlock) >= blockSize + MIN_BLOCK)
+    {
+        size_t remainderSize = getSize(currentBlock) - blockSize - BLOCK_OVERHEAD;
+        setBlock(currentBlock, blockSize, USED);
+        // Calculate the address of the new block
+        memoryBlockHeader *newBlock = nextPhysicalBlock(heapIndex, currentBlock);
+        setBlock(newBlock, remainderSize, FREE);
+        freeListInsert(heapIndex, newBlock);
+    }
+    else
+    {
+        setBlock(currentBlock, getSize(currentBlock), USED);
+    }
+    markGranules(heapIndex, currentBlock, getSize(currentBlock) + BLOCK_OVERHEAD, USED);
+    // Return the address of the block
+    return (unsigned char *)currentBlock + sizeof(memoryBlockHeader);
+}
+
+void *spaceMalloc(int heapIndex, size_t blockSize)
+{
+    // allocate from a heap's free list, growing the heap when nothing fits
+    memoryBlockHeader *currentBlock = findFreeBlock(heapIndex, blockSize);
+    if (currentBlock == NULL)
+    {
+        // return NULL once the heap cannot grow
+        if (!growHeap(heapIndex, blockSize + BLOCK_OVERHEAD))
+        {
+            return NULL;
+        }
+        currentBlock = findFreeBlock(heapIndex, blockSize);
+    }
+    return takeFreeBlock(heapIndex, currentBlock, blockSize);
+}
+
+void *oldMalloc(int size)
+{
+    // unmanaged blocks and promoted survivors live in the old heap, which is never evacuated
+    return spaceMalloc(OLD_HEAP, requestSize(size));
+}
+
+void resizeUsedBlock(memoryBlockHeader *block, size_t size)
+{
+    // rewrite a used block for a new size, keeping its managed index, age and owner
+    int index = getManagedIndex(block);
+    int age = getAge(block);
+    struct threadCache *owner = getOwner(block);
+    setBlock(block, size, USED);
+    setManagedIndex(block, index);
+    setAge(block, age);
+    setOwner(block, owner);
+}
+
+int resizeInPlace(int heapIndex, memoryBlockHeader *block, size_t blockSize)
+{
+    // make a used block hold blockSize bytes without moving it, returns 0 when it has to move
+    size_t size = getSize(block);
+    unsigned char *end = (unsigned char *)block + BLOCK_OVERHEAD + size;
+    if (end == bumpPointer[heapIndex])
+    {
+        // the last bumped block just moves the bump pointer, under the same slack rule as youngMalloc
+        size_t available = size + (heap[heapIndex] + heapSize[heapIndex] - end);
+        if (blockSize > available)
+        {
+            return 0;
+        }
+        if (available - blockSize < MIN_BLOCK)
+        {
+            blockSize = available;
+        }
+        resizeUsedBlock(block, blockSize);
+        bumpPointer[heapIndex] = (unsigned char *)block + BLOCK_OVERHEAD + blockSize;
+        if (bumpPointer[heapIndex] > untouched[heapIndex])
+        {
+            untouched[heapIndex] = bumpPointer[heapIndex];
+        }
+        return 1;
+    }
+    if (blockSize > size)
+    {
+        // absorb the physical successor when it is free and big enough
+        memoryBlockHeader *nextBlock = nextPhysicalBlock(heapIndex, block);
+        if (nextBlock == NULL || !isFree(nextBlock) || size + BLOCK_OVERHEAD + getSize(nextBlock) < blockSize)
+        {
+            return 0;
+        }
+        freeListRemove(heapIndex, nextBlock);
+        markGranules(heapIndex, nextBlock, BLOCK_OVERHEAD + getSize(nextBlock), USED);
+        size += BLOCK_OVERHEAD + getSize(nextBlock);
+        resizeUsedBlock(block, size);
+    }
+    // give back a tail big enough to be a block, it coalesces with a free successor
+    if (size >= blockSize + MIN_BLOCK)
+    {
+        resizeUsedBlock(block, blockSize);
+        memoryBlockHeader *tail = nextPhysicalBlock(heapIndex, block);
+        setBlock(tail, size - blockSize - BLOCK_OVERHEAD, USED);
+        freeBlock(heapIndex, tail);
+    }
+    return 1;
+}
+
+size_t alignmentPadding(unsigned char *block, size_t align)
+{
+    // bytes to leave in front of a block header so its payload lands on align
+    // either none or enough for a block of its own
+    size_t pad = -(uintptr_t)(block + sizeof(memoryBlockHeader)) & (align - 1);
+    if (pad > 0 && pad < MIN_BLOCK)
+    {
+        pad += (MIN_BLOCK - pad + align - 1) & ~(align - 1);
+    }
+    return pad;
+}
+
+size_t alignmentSlack(size_t align)
+{
+    // the most alignmentPadding can ask for
+    return align > DEFAULT_ALIGNMENT ? MIN_BLOCK + align - DEFAULT_ALIGNMENT : 0;
+}
+
+size_t slotAlignment(int index)
+{
+    return managedAlignments[index] != 0 ? (size_t)1 << managedAlignments[index] : DEFAULT_ALIGNMENT;
+}
+
+void *carveAligned(int heapIndex, void *region, size_t blockSize, size_t align)
+{
+    // cut an aligned block of blockSize out of a region alignmentSlack bigger
+    // the space in front and behind it is freed, so it coalesces with its neighbours and is reused
+    memoryBlockHeader *block = (memoryBlockHeader *)((unsigned char *)region - sizeof(memoryBlockHeader));
+    size_t pad = alignmentPadding((unsigned char *)block, align);
+    if (pad > 0)
+    {
+        memoryBlockHeader *front = block;
+        block = (memoryBlockHeader *)((unsigned char *)front + pad);
+        setBlock(block, getSize(front) - pad, USED);
+        setBlock(front, pad - BLOCK_OVERHEAD, USED);
+        freeBlock(heapIndex, front);
+    }
+    resizeInPlace(heapIndex, block, blockSize);
+    return (unsigned char *)block + sizeof(memoryBlockHeader);
+}
+
+void *oldMallocAligned(size_t blockSize, size_t align)
+{
+    if (align <= DEFAULT_ALIGNMENT)
+    {
+        return spaceMalloc(OLD_HEAP, blockSize);
+    }
+    void *region = spaceMalloc(OLD_HEAP, blockSize + alignmentSlack(align));
+    return region != NULL ? carveAligned(OLD_HEAP, region, blockSize, align) : NULL;
+}
+
+int isLargeRequest(size_t blockSize, size_t align)
+{
+    return largeObjectThreshold > 0 && blockSize >= largeObjectThreshold && align <= HEAP_PAGE;
+}
+
+void *largeMalloc(size_t blockSize, size_t align)
+{
+    // a page aligned mapping of its own, never copied by a collection and unmapped when freed
+    // the header sits just far enough in for the payload to land on align
+    size_t offset = (0 - sizeof(memoryBlockHeader)) & (align - 1);
+    size_t length = roundToPage(offset + BLOCK_OVERHEAD + blockSize);
+    unsigned char *mapping = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mapping == MAP_FAILED)
+    {
+        return NULL;
+    }
+    memoryBlockHeader *block = (memoryBlockHeader *)(mapping + offset);
+    setBlock(block, length - offset - BLOCK_OVERHEAD, USED);
+    stats.largeObjects++;
+    stats.largeObjectBytes += length;
+    allocationZeroed = 1; // fresh anonymous pages
+    return (unsigned char *)block + sizeof(memoryBlockHeader);
+}
+
+void largeFree(memoryBlockHeader *block)
+{
+    size_t length;
+    unsigned char *mapping = largeMapping(block, &length);
+    stats.largeObjects--;
+    stats.largeObjectBytes -= length;
+    munmap(mapping, length);
+}
+
+memoryBlockHeader *largeResize(memoryBlockHeader *block, size_t blockSize)
+{
+    // remap to the new size, the kernel moves the pages if it must rather than copying them
+    // returns the block at its possibly new address, NULL with the block untouched on failure
+    size_t length;
+    unsigned char *mapping = largeMapping(block, &length);
+    size_t offset = (unsigned char *)block - mapping;
+    size_t newLength = roundToPage(offset + BLOCK_OVERHEAD + blockSize);
+    if (newLength != length)
+    {
+        unsigned char *remapped = mremap(mapping, length, newLength, MREMAP_MAYMOVE);
+        if (remapped == MAP_FAILED)
+        {
+            return NULL;
+        }
+        stats.largeObjectBytes += newLength - length;
+        block = (memoryBlockHeader *)(remapped + offset);
+    }
+    resizeUsedBlock(block, newLength - offset - BLOCK_OVERHEAD);
+    return block;
+}
+
+void splitRegion(void *region, size_t blockSize, int count)
+{
+    // cut one allocated region into count used blocks of blockSize in a single pass
+    // the last block keeps any slack the heap could not split off
+    memoryBlockHeader *regionBlock = (memoryBlockHeader *)((unsigned char *)region - sizeof(memoryBlockHeader));
+    size_t stride = blockSize + BLOCK_OVERHEAD;
+    size_t regionSize = getSize(regionBlock) + BLOCK_OVERHEAD;
+    for (int i = 0; i < count; i++)
+    {
+        memoryBlockHeader *block = (memoryBlockHeader *)((unsigned char *)regionBlock + i * stride);
+        setBlock(block, i < count - 1 ? blockSize : regionSize - i * stride - BLOCK_OVERHEAD, USED);
+    }
+}
+
+void freeRun(memoryBlockHeader *first, memoryBlockHeader *last, int blocks)
+{
+    // free physically adjacent used blocks first..last as one block, so the free list is touched once
+    int heapIndex = heapIndexOf(first);
+    setBlock(first, (unsigned char *)last + getSize(last) - (unsigned char *)first, USED);
+    coalesceCount += blocks - 1;
+    freeBlock(heapIndex, first);
+}
+
+int compareAddress(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)*(void *const *)a;
+    uintptr_t y = (uintptr_t)*(void *const *)b;
+    return x < y ? -1 : x > y;
+}
+
+int compareManagedAddress(const void *a, const void *b)
+{
+    // order handles by the address of the block they refer to
+    uintptr_t x = (uintptr_t)**(void **const *)a;
+    uintptr_t y = (uintptr_t)**(void **const *)b;
+    return x < y ? -1 : x > y;
+}
+
+void sortAddresses(void **items, int count, int (*compare)(const void *, const void *))
+{
+    // batches usually come back in the order they were carved, so check before sorting
+    for (int i = 1; i < count; i++)
+    {
+        if (compare(&items[i - 1], &items[i]) > 0)
+        {
+            qsort(items, count, sizeof(void *), compare);
+            return;
+        }
+    }
+}
+
+int promoteBlock(int index, memoryBlockHeader *oldBlock, int age, size_t *bytesCopied)
+{
+    // move a block to the old heap, 0 when the old heap is full
+    void *promoted = oldMallocAligned(getSize(oldBlock), slotAlignment(index));
+    if (promoted == NULL)
+    {
+        return 0;
+    }
+    memoryBlockHeader *newBlock = (memoryBlockHeader *)((unsigned char *)promoted - sizeof(memoryBlockHeader));
+    memcpy(promoted, managedList[index], getSize(oldBlock));
+    *bytesCopied += getSize(oldBlock);
+    // the old heap may hand out a little more than asked for
+    stats.bytesAllocated += getSize(newBlock) - getSize(oldBlock);
+    setManagedIndex(newBlock, index);
+    setAge(newBlock, age);
+    managedList[index] = promoted;
+    return 1;
+}
+
+void growCopiedBlock(memoryBlockHeader *block, size_t extra)
+{
+    // hand a copied block slack that cannot become a block of its own, keeping its index and age
+    int index = getManagedIndex(block);
+    int age = getAge(block);
+    setBlock(block, getSize(block) + extra, USED);
+    setManagedIndex(block, index);
+    setAge(block, age);
+}
+
+unsigned char *claimToSpace(int heapIndex, size_t needed, size_t wanted, size_t *claimed)
+{
+    // claim wanted bytes of to-space, or at least needed when less is left, NULL once even that is gone
+    // a claim never leaves a tail too small to become the bump space
+    unsigned char *end = heap[heapIndex] + heapSize[heapIndex];
+    unsigned char *top = atomic_load_explicit(&evacuationTop, memory_order_relaxed);
+    size_t take;
+    do
+    {
+        size_t remaining = end - top;
+        if (remaining < needed)
+        {
+            return NULL;
+        }
+        take = wanted < remaining ? wanted : remaining;
+        if (remaining - take < MIN_BLOCK)
+        {
+            take = remaining;
+        }
+    } while (!atomic_compare_exchange_weak_explicit(&evacuationTop, &top, top + take, memory_order_relaxed, memory_order_relaxed));
+    *claimed = take;
+    return top;
+}
+
+void retirePlab(evacuationWorker *worker)
+{
+    // the unused end of a buffer becomes a dead block the next collection drops
+    // it is only too small for that at the end of the to-space, then it is slack for the last copy
+    size_t remaining = worker->plabEnd - worker->plab;
+    if (remaining >= MIN_BLOCK)
+    {
+        setBlock((memoryBlockHeader *)worker->plab, remaining - BLOCK_OVERHEAD, USED);
+    }
+    else if (remaining > 0)
+    {
+        growCopiedBlock(worker->lastCopied, remaining);
+        worker->slack += remaining;
+    }
+    worker->plab = NULL;
+    worker->plabEnd = NULL;
+    worker->lastCopied = NULL;
+}
+
+void copyToPlab(evacuationWorker *worker, int index, memoryBlockHeader *oldBlock, int age)
+{
+    size_t needed = getSize(oldBlock) + BLOCK_OVERHEAD;
+    size_t align = slotAlignment(index);
+    memoryBlockHeader *newBlock;
+    size_t extra = 0;
+    size_t pad = 0;
+    if (needed > PLAB_BYTES / 4)
+    {
+        // big blocks would waste too much of a buffer, they get a claim of exactly their size
+        // an aligned one claims a block more, so whatever its padding leaves behind can be a dead block
+        size_t wanted = needed + alignmentSlack(align) + (align > DEFAULT_ALIGNMENT ? MIN_BLOCK : 0);
+        size_t claimed = wanted;
+        newBlock = (memoryBlockHeader *)claimToSpace(worker->heapIndex, wanted, wanted, &claimed);
+        if (newBlock != NULL)
+        {
+            pad = alignmentPadding((unsigned char *)newBlock, align);
+            extra = claimed - pad - needed;
+            if (extra >= MIN_BLOCK)
+            {
+                // alignment left more behind the copy than it can take as slack
+                setBlock((memoryBlockHeader *)((unsigned char *)newBlock + pad + needed), extra - BLOCK_OVERHEAD, USED);
+                extra = 0;
+            }
+        }
+    }
+    else
+    {
+        pad = worker->plab != NULL ? alignmentPadding(worker->plab, align) : 0;
+        size_t left = worker->plab != NULL ? worker->plabEnd - worker->plab : 0;
+        // a copy never leaves less than a block behind, growing the last copy would make liveBytes
+        // depend on where the buffers happened to end
+        if (worker->plab == NULL || left < pad + needed || (left > pad + needed && left - pad - needed < MIN_BLOCK))
+        {
+            if (worker->plab != NULL)
+            {
+                retirePlab(worker);
+            }
+            size_t claimed = 0;
+            worker->plab = claimToSpace(worker->heapIndex, needed + alignmentSlack(align), PLAB_BYTES, &claimed);
+            worker->plabEnd = worker->plab != NULL ? worker->plab + claimed : NULL;
+            pad = worker->plab != NULL ? alignmentPadding(worker->plab, align) : 0;
+        }
+        newBlock = (memoryBlockHeader *)worker->plab;
+        if (newBlock != NULL)
+        {
+            worker->plab += pad + needed;
+            worker->lastCopied = (memoryBlockHeader *)((unsigned char *)newBlock + pad);
+        }
+    }
+    if (newBlock != NULL && pad > 0)
+    {
+        // a dead block in front keeps an aligned copy aligned, the next collection drops it
+        setBlock(newBlock, pad - BLOCK_OVERHEAD, USED);
+        newBlock = (memoryBlockHeader *)((unsigned char *)newBlock + pad);
+    }
+    if (newBlock == NULL)
+    {
+        // buffer waste filled the to-space, promote early rather than fail
+        pthread_mutex_lock(&promotionLock);
+        int promoted = promoteBlock(index, oldBlock, age, &worker->bytesCopied);
+        pthread_mutex_unlock(&promotionLock);
+        if (!promoted)
+        {
+            printf("Unable to evacuate the young heap\n");
+            exit(1);
+        }
+        return;
+    }
+    setBlock(newBlock, getSize(oldBlock) + extra, USED);
+    memcpy(newBlock + 1, managedList[index], getSize(oldBlock));
+    setManagedIndex(newBlock, index);
+    setAge(newBlock, age);
+    managedList[index] = newBlock + 1;
+    worker->bytesCopied += getSize(oldBlock);
+    worker->slack += extra;
+}
+
+void *evacuationWorkerRun(void *arg)
+{
+    // claim chunks of the Managed List until none are left, each slot belongs to exactly one thread
+    evacuationWorker *worker = arg;
+    unsigned char *from = heap[1 - worker->heapIndex];
+    unsigned char *fromEnd = from + heapSize[1 - worker->heapIndex];
+    int chunk;
+    while ((chunk = atomic_fetch_add_explicit(&evacuationNextChunk, 1, memory_order_relaxed)) < (managedListSize + EVACUATION_CHUNK - 1) / EVACUATION_CHUNK)
+    {
+        int end = (chunk + 1) * EVACUATION_CHUNK < managedListSize ? (chunk + 1) * EVACUATION_CHUNK : managedListSize;
+        for (int i = chunk * EVACUATION_CHUNK; i < end; i++)
+        {
+            unsigned char *payload = managedList[i];
+            if (!SLOT_IN_USE(payload) || payload < from || payload >= fromEnd)
+            {
+                continue;
+            }
+            memoryBlockHeader *oldBlock = (memoryBlockHeader *)(payload - sizeof(memoryBlockHeader));
+            int age = getAge(oldBlock) < 255 ? getAge(oldBlock) + 1 : 255;
+            if (age >= promotionAge)
+            {
+                pthread_mutex_lock(&promotionLock);
+                int promoted = promoteBlock(i, oldBlock, age, &worker->bytesCopied);
+                pthread_mutex_unlock(&promotionLock);
+                if (promoted)
+                {
+                    continue;
+                }
+            }
+            copyToPlab(worker, i, oldBlock, age);
+        }
+    }
+    if (worker->plab != NULL)
+    {
+        retirePlab(worker);
+    }
+    return NULL;
+}
+
+unsigned char *parallelEvacuate(int newHeapIndex, size_t *bytesCopied)
+{
+    // the collecting thread works too, returns the end of the claimed to-space
+    evacuationWorker workers[MAX_COLLECTION_THREADS];
+    memset(workers, 0, sizeof(workers));
+    atomic_store(&evacuationNextChunk, 0);
+    atomic_store(&evacuationTop, heap[newHeapIndex]);
+    int started = 1;
+    for (int w = 0; w < collectionThreads; w++)
+    {
+        workers[w].heapIndex = newHeapIndex;
+        if (w > 0 && started == w && pthread_create(&workers[w].thread, NULL, evacuationWorkerRun, &workers[w]) == 0)
+        {
+            started++;
+        }
+    }
+    evacuationWorkerRun(&workers[0]);
+    for (int w = 1; w < started; w++)
+    {
+        pthread_join(workers[w].thread, NULL);
+    }
+    // the helpers promote under promotionLock, stats is only safe to touch once they are done
+    for (int w = 0; w < started; w++)
+    {
+        *bytesCopied += workers[w].bytesCopied;
+        stats.bytesAllocated += workers[w].slack;
+    }
+    return atomic_load(&evacuationTop);
+}
+
+unsigned char *serialEvacuate(int newHeapIndex, size_t *bytesCopied)
+{
+    // copy survivors in Managed List order, returns the end of the copies
+    unsigned char *copyPointer = heap[newHeapIndex];
+    memoryBlockHeader *lastCopied = NULL;
+    for (int i = 0; i < managedListSize; i++)
+    {
+        if (!SLOT_IN_USE(managedList[i]) || heapIndexOf(managedList[i]) != currentHeapIndex)
+        {
+            continue;
+        }
+        memoryBlockHeader *oldBlock = (memoryBlockHeader *)((unsigned char *)managedList[i] - sizeof(memoryBlockHeader));
+        int age = getAge(oldBlock) < 255 ? getAge(oldBlock) + 1 : 255;
+        if (age >= promotionAge && promoteBlock(i, oldBlock, age, bytesCopied))
+        {
+            continue;
+        }
+        // the old heap is full or the block is too young, it stays in the young generation
+        size_t pad = alignmentPadding(copyPointer, slotAlignment(i));
+        if (copyPointer + pad + BLOCK_OVERHEAD + getSize(oldBlock) > heap[newHeapIndex] + heapSize[newHeapIndex])
+        {
+            // padding for alignment can leave the survivors more than the heap they came from
+            if (!promoteBlock(i, oldBlock, age, bytesCopied))
+            {
+                printf("Unable to evacuate the young heap\n");
+                exit(1);
+            }
+            continue;
+        }
+        if (pad > 0)
+        {
+            // a dead block in front keeps an aligned copy aligned, the next collection drops it
+            setBlock((memoryBlockHeader *)copyPointer, pad - BLOCK_OVERHEAD, USED);
+            copyPointer += pad;
+        }
+        lastCopied = (memoryBlockHeader *)copyPointer;
+        setBlock(lastCopied, getSize(oldBlock), USED);
+        memcpy(lastCopied + 1, managedList[i], getSize(oldBlock));
+        setManagedIndex(lastCopied, i);
+        setAge(lastCopied, age);
+        copyPointer += BLOCK_OVERHEAD + getSize(lastCopied);
+        *bytesCopied += getSize(lastCopied);
+    }
+    size_t tail = heap[newHeapIndex] + heapSize[newHeapIndex] - copyPointer;
+    if (tail > 0 && tail < MIN_BLOCK)
+    {
+        // too small for the bump space, the last survivor takes it
+        growCopiedBlock(lastCopied, tail);
+        stats.bytesAllocated += tail;
+        copyPointer += tail;
+    }
+    // Cheney scan over the survivors, pointing each Managed List slot at its block's new address
+    unsigned char *scanPointer = heap[newHeapIndex];
+    while (scanPointer < copyPointer)
+    {
+        memoryBlockHeader *block = (memoryBlockHeader *)scanPointer;
+        if (getManagedIndex(block) >= 0)
+        {
+            managedList[getManagedIndex(block)] = scanPointer + sizeof(memoryBlockHeader);
+        }
+        scanPointer += BLOCK_OVERHEAD + getSize(block);
+    }
+    return copyPointer;
+}
+
+void *youngMalloc(size_t blockSize)
+{
+    // allocate from the current young heap without growing it, NULL when it is full
+    unsigned char *bump = bumpPointer[currentHeapIndex];
+    if (bump == NULL)
+    {
+        memoryBlockHeader *currentBlock = findFreeBlock(currentHeapIndex, blockSize);
+        return currentBlock != NULL ? takeFreeBlock(currentHeapIndex, currentBlock, blockSize) : NULL;
+    }
+    // Fast path while nothing has been freed: a pointer increment and a limit check
+    size_t remaining = heap[currentHeapIndex] + heapSize[currentHeapIndex] - bump;
+    if (remaining < blockSize + BLOCK_OVERHEAD)
+    {
+        return NULL;
+    }
+    if (remaining - blockSize - BLOCK_OVERHEAD < MIN_BLOCK)
+    {
+        // take the slack too, the bump space never gets too small to become a free block
+        blockSize = remaining - BLOCK_OVERHEAD;
+    }
+    memoryBlockHeader *block = (memoryBlockHeader *)bump;
+    bumpPointer[currentHeapIndex] = bump + blockSize + BLOCK_OVERHEAD;
+    allocationZeroed = bump >= untouched[currentHeapIndex];
+    if (allocationZeroed)
+    {
+        untouched[currentHeapIndex] = bumpPointer[currentHeapIndex];
+    }
+    setBlock(block, blockSize, USED);
+    return bump + sizeof(memoryBlockHeader);
+}
+
+void releaseYoungHeap(int heapIndex)
+{
+    // a young heap nothing lives in any more gives its pages back, they read as zero when next touched
+    if (heapMapped[heapIndex] < RELEASE_MIN_BYTES)
+    {
+        untouched[heapIndex] = heap[heapIndex] + heapReserve; // nothing is known to be zero
+        return;
+    }
+    madvise(heap[heapIndex], heapMapped[heapIndex], MADV_DONTNEED);
+    untouched[heapIndex] = heap[heapIndex];
+    stats.bytesReleased += heapMapped[heapIndex];
+}
+
+void *youngMallocAligned(size_t blockSize, size_t align)
+{
+    if (align <= DEFAULT_ALIGNMENT)
+    {
+        return youngMalloc(blockSize);
+    }
+    unsigned char *bump = bumpPointer[currentHeapIndex];
+    if (bump == NULL)
+    {
+        void *region = youngMalloc(blockSize + alignmentSlack(align));
+        return region != NULL ? carveAligned(currentHeapIndex, region, blockSize, align) : NULL;
+    }
+    // while bumping, pad with a dead block rather than freeing, the next collection drops it
+    size_t pad = alignmentPadding(bump, align);
+    if ((size_t)(heap[currentHeapIndex] + heapSize[currentHeapIndex] - bump) < pad + blockSize + BLOCK_OVERHEAD)
+    {
+        return NULL;
+    }
+    if (pad > 0)
+    {
+        setBlock((memoryBlockHeader *)bump, pad - BLOCK_OVERHEAD, USED);
+        bumpPointer[currentHeapIndex] = bump + pad;
+    }
+    return youngMalloc(blockSize);
+}
+
+int inIncrementalFrom(void *ptr)
+{
+    return incrementalFrom >= 0 && (unsigned char *)ptr >= heap[incrementalFrom] &&
+           (unsigned char *)ptr < heap[incrementalFrom] + heapSize[incrementalFrom];
+}
+
+void releaseStorage(memoryBlockHeader *block)
+{
+    // give a managed block's space back, heap lock held
+    if (isLargeObject(block))
+    {
+        largeFree(block);
+    }
+    else if (!inIncrementalFrom(block))
+    {
+        // a block waiting to be evacuated needs no free, its heap is dropped whole
+        freeBlock(heapIndexOf(block), block);
+    }
+}
+
+void countAllocation(void *ptr)
+{
+    // heap lock held
+    stats.allocations[allocationStrategy]++;
+    stats.bytesAllocated += getSize((memoryBlockHeader *)((unsigned char *)ptr - sizeof(memoryBlockHeader)));
+}
+
+void countFree(memoryBlockHeader *block)
+{
+    // heap lock held
+    stats.frees++;
+    stats.bytesFreed += getSize(block);
+}
+
+void countResize(size_t oldSize, size_t newSize)
+{
+    // heap lock held, a block resized in place counts its growth as allocated and its shrinkage as freed
+    if (newSize > oldSize)
+    {
+        stats.bytesAllocated += newSize - oldSize;
+    }
+    else
+    {
+        stats.bytesFreed += oldSize - newSize;
+    }
+}
+
+int allocateManagedSlot()
+{
+    // reuse the most recently vacated slot, otherwise append, mapping more of the list when it is full
+    int index = managedFreeSlot;
+    if (index >= 0)
+    {
+        managedFreeSlot = managedNextFree[index];
+        return index;
+    }
+    // appended slots start untyped since their mappings are fresh
+    if (managedListSize < managedListCapacity || growManagedList())
+    {
+        return managedListSize++;
+    }
+    return -1;
+}
+
+void releaseManagedSlot(int index)
+{
+    // chain the slot onto the vacated list and invalidate handles to it
+    managedList[index] = NULL;
+    managedNextFree[index] = managedFreeSlot;
+    managedFreeSlot = index;
+    managedGenerations[index]++;
+    managedAlignments[index] = 0;
+    if (managedTypes[index] != NULL)
+    {
+        managedTypes[index] = NULL;
+        typedBlockCount--;
+    }
+}
+
+void markHandle(void **handle, int *stackSize)
+{
+    // mark the block a handle refers to, anything that is not a live handle is ignored
+    uintptr_t offset = (uintptr_t)handle - (uintptr_t)managedList;
+    if ((uintptr_t)handle < (uintptr_t)managedList || offset / sizeof(void *) >= (size_t)managedListSize || offset % sizeof(void *) != 0)
+    {
+        return;
+    }
+    int index = offset / sizeof(void *);
+    if (!SLOT_IN_USE(managedList[index]) || managedMarks[index])
+    {
+        return;
+    }
+    managedMarks[index] = 1;
+    if (managedTypes[index] != NULL)
+    {
+        markStack[(*stackSize)++] = index;
+    }
+}
+
+void reclaimUnreachable(int abandonedHeap)
+{
+    // mark from the roots and the untyped blocks, then free every typed block that was not reached
+    // blocks in abandonedHeap, about to be evacuated, only give up their slot
+    memset(managedMarks, 0, managedListSize);
+    int stackSize = 0;
+    for (int i = 0; i < rootCount; i++)
+    {
+        markHandle(*roots[i], &stackSize);
+    }
+    for (int i = 0; i < managedListSize; i++)
+    {
+        if (SLOT_IN_USE(managedList[i]) && managedTypes[i] == NULL)
+        {
+            managedMarks[i] = 1;
+        }
+    }
+    while (stackSize > 0)
+    {
+        int index = markStack[--stackSize];
+        const duType *type = managedTypes[index];
+        for (int f = 0; f < type->handleCount; f++)
+        {
+            void **handle;
+            memcpy(&handle, (unsigned char *)managedList[index] + type->handleOffsets[f], sizeof(handle));
+            markHandle(handle, &stackSize);
+        }
+    }
+    for (int i = 0; i < managedListSize; i++)
+    {
+        if (!SLOT_IN_USE(managedList[i]) || managedMarks[i])
+        {
+            continue;
+        }
+        if (atomic_load_explicit(&tracing, memory_order_relaxed))
+        {
+            traceRelease(DU_TRACE_MANAGED_FREE, &managedList[i]);
+        }
+        memoryBlockHeader *block = (memoryBlockHeader *)((unsigned char *)managedList[i] - sizeof(memoryBlockHeader));
+        countFree(block);
+        stats.blocksReclaimed++;
+        if (abandonedHeap < 0 || heapIndexOf(block) != abandonedHeap)
+        {
+            releaseStorage(block);
+        }
+        releaseManagedSlot(i);
+    }
+}
+
+void startIncrementalCycle()
+{
+    // allocation moves to the other young heap straight away, survivors follow it step by step
+    incrementalFrom = currentHeapIndex;
+    incrementalCursor = 0;
+    bumpPointer[currentHeapIndex] = NULL;
+    currentHeapIndex = 1 - currentHeapIndex;
+    initFreeList(currentHeapIndex, NULL);
+    bumpPointer[currentHeapIndex] = heap[currentHeapIndex];
+    bytesSinceCollection = 0;
+    // the mark is not incremental, it runs once at the start as a snapshot
+    if (typedBlockCount > 0)
+    {
+        reclaimUnreachable(-1);
+    }
+}
+
+size_t evacuateSlot(int index)
+{
+    // move one block out of the heap being collected, returns the bytes copied
+    memoryBlockHeader *oldBlock = (memoryBlockHeader *)((unsigned char *)managedList[index] - sizeof(memoryBlockHeader));
+    int age = getAge(oldBlock) < 255 ? getAge(oldBlock) + 1 : 255;
+    size_t bytesCopied = 0;
+    if (age >= promotionAge && promoteBlock(index, oldBlock, age, &bytesCopied))
+    {
+        return bytesCopied;
+    }
+    void *copy = youngMallocAligned(getSize(oldBlock), slotAlignment(index));
+    if (copy == NULL)
+    {
+        // blocks allocated during the cycle filled the to-space, promote early rather than fail
+        if (!promoteBlock(index, oldBlock, age, &bytesCopied))
+        {
+            printf("Unable to evacuate the young heap\n");
+            exit(1);
+        }
+        return bytesCopied;
+    }
+    memoryBlockHeader *newBlock = (memoryBlockHeader *)((unsigned char *)copy - sizeof(memoryBlockHeader));
+    memcpy(copy, managedList[index], getSize(oldBlock));
+    // the young heap may hand out a little more than asked for
+    stats.bytesAllocated += getSize(newBlock) - getSize(oldBlock);
+    setManagedIndex(newBlock, index);
+    setAge(newBlock, age);
+    managedList[index] = copy;
+    return getSize(oldBlock);
+}
+
+int incrementalStep(double budgetMicros, struct timespec *start, size_t *bytesCopied)
+{
+    // evacuate from the cursor until the budget is spent, a negative budget runs the cycle to the end
+    // returns 1 while the cycle has slots left
+    while (incrementalCursor < managedListSize)
+    {
+        int end = incrementalCursor + STEP_SLOTS < managedListSize ? incrementalCursor + STEP_SLOTS : managedListSize;
+        for (; incrementalCursor < end; incrementalCursor++)
+        {
+            if (SLOT_IN_USE(managedList[incrementalCursor]) && inIncrementalFrom(managedList[incrementalCursor]))
+            {
+                *bytesCopied += evacuateSlot(incrementalCursor);
+            }
+        }
+        if (budgetMicros >= 0 && microsSince(start) >= budgetMicros)
+        {
+            break;
+        }
+    }
+    if (incrementalCursor < managedListSize)
+    {
+        return 1;
+    }
+    // every survivor has left, the old young heap is simply abandoned
+    releaseYoungHeap(incrementalFrom);
+    incrementalFrom = -1;
+    stats.minorCollections++;
+    return 0;
+}
+
+void finishIncrementalCycle()
+{
+    if (incrementalFrom < 0)
+    {
+        return;
+    }
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t bytesCopied = 0;
+    incrementalStep(-1, &start, &bytesCopied);
+    recordCollection(&start, bytesCopied);
+}
+
+void evacuateYoungHeap()
+{
+    // Evacuate every live young managed block into the other heap, packed from its start
+    // blocks that have survived promotionAge collections move to the old heap instead
+    // a running incremental cycle is finished first, so the other young heap is empty
+    finishIncrementalCycle();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t bytesCopied = 0;
+    if (typedBlockCount > 0)
+    {
+        reclaimUnreachable(currentHeapIndex);
+    }
+    int newHeapIndex = 1 - currentHeapIndex;
+    unsigned char *copyPointer;
+    if (collectionThreads > 1 && managedListSize >= PARALLEL_MIN_SLOTS &&
+        heapSize[currentHeapIndex] - youngFreeBytes() >= PARALLEL_MIN_BYTES)
+    {
+        copyPointer = parallelEvacuate(newHeapIndex, &bytesCopied);
+    }
+    else
+    {
+        copyPointer = serialEvacuate(newHeapIndex, &bytesCopied);
+    }
+    // everything after the survivors is one free region, allocated from by bumping until something is freed
+    bumpPointer[currentHeapIndex] = NULL;
+    releaseYoungHeap(currentHeapIndex);
+    currentHeapIndex = newHeapIndex;
+    initFreeList(currentHeapIndex, NULL);
+    bumpPointer[currentHeapIndex] = copyPointer;
+    if (copyPointer > untouched[currentHeapIndex])
+    {
+        untouched[currentHeapIndex] = copyPointer;
+    }
+    bytesSinceCollection = 0;
+    stats.minorCollections++;
+    recordCollection(&start, bytesCopied);
+}
+
+void *heapMalloc(int size, size_t align)
+{
+    // Calculate the size of the block to allocate in the young heap
+    size_t blockSize = requestSize(size);
+    // Collect early when the policy says the young heap is full enough
+    if ((collectionBudget > 0 && bytesSinceCollection >= collectionBudget) || overCollectionOccupancy())
+    {
+        evacuateYoungHeap();
+        if (youngFreeBytes() < heapSize[currentHeapIndex] / 4 || overCollectionOccupancy())
+        {
+            // mostly live or still over the trigger, grow or the next allocation collects again
+            growHeap(currentHeapIndex, blockSize + BLOCK_OVERHEAD + alignmentSlack(align));
+        }
+    }
+    void *ptr = youngMallocAligned(blockSize, align);
+    if (ptr == NULL)
+    {
+        // Out of space: collect and retry before growing
+        evacuateYoungHeap();
+        if (youngFreeBytes() < heapSize[currentHeapIndex] / 4)
+        {
+            // mostly live data, grow now rather than collecting again on the next few allocations
+            growHeap(currentHeapIndex, blockSize + BLOCK_OVERHEAD + alignmentSlack(align));
+        }
+        ptr = youngMallocAligned(blockSize, align);
+        if (ptr == NULL && growHeap(currentHeapIndex, blockSize + BLOCK_OVERHEAD + alignmentSlack(align)))
+        {
+            ptr = youngMallocAligned(blockSize, align);
+        }
+    }
+    if (ptr != NULL)
+    {
+        // only blocks actually handed out count towards the budget
+        bytesSinceCollection += blockSize + BLOCK_OVERHEAD;
+    }
+    return ptr; // NULL once the heap cannot grow
+}
+
+void releaseCachedBlock(memoryBlockHeader *block)
+{
+    // hand a cached block back to the shared heap, the heap lock must be held
+    setOwner(block, NULL);
+    freeBlock(OLD_HEAP, block);
+}
+
+void checkCacheEpoch(threadCache *cache)
+{
+    // the heaps were reset since the bins were filled, so their blocks are gone
+    int epoch = atomic_load_explicit(&cacheEpoch, memory_order_acquire);
+    if (cache->epoch != epoch)
+    {
+        memset(cache->bins, 0, sizeof(cache->bins));
+        memset(cache->counts, 0, sizeof(cache->counts));
+        cache->epoch = epoch;
+    }
+}
+
+void releaseRemoteFrees(threadCache *cache)
+{
+    // hand the blocks other threads freed into cache back to the shared heap, the heap lock must be held
+    memoryBlockHeader *block = atomic_exchange(&cache->remoteFrees, NULL);
+    while (block != NULL)
+    {
+        memoryBlockHeader *next = getNext(block);
+        releaseCachedBlock(block);
+        block = next;
+    }
+}
+
+void flushThreadCache(void *arg)
+{
+    // runs when the owning thread exits, every cached block goes back to the heap
+    threadCache *cache = arg;
+    lockHeap();
+    checkCacheEpoch(cache);
+    for (int i = 0; i < CACHE_CLASSES; i++)
+    {
+        while (cache->bins[i] != NULL)
+        {
+            memoryBlockHeader *block = cache->bins[i];
+            cache->bins[i] = getNext(block);
+            releaseCachedBlock(block);
+        }
+        cache->counts[i] = 0;
+    }
+    // unclaimed first, so a remote free either lands before the drain or sees the cache is unclaimed
+    atomic_store(&cache->inUse, 0);
+    releaseRemoteFrees(cache);
+    unlockHeap();
+}
+
+void makeCacheKey()
+{
+    pthread_key_create(&cacheKey, flushThreadCache);
+}
+
+threadCache *getThreadCache()
+{
+    if (myCache != NULL)
+    {
+        return myCache;
+    }
+    pthread_once(&cacheKeyOnce, makeCacheKey);
+    lockHeap();
+    for (int i = 0; i < MAX_THREAD_CACHES; i++)
+    {
+        if (!threadCaches[i].inUse)
+        {
+            threadCaches[i].inUse = 1;
+            myCache = &threadCaches[i];
+            break;
+        }
+    }
+    unlockHeap();
+    if (myCache != NULL)
+    {
+        pthread_setspecific(cacheKey, myCache);
+    }
+    return myCache; // NULL when every cache is taken, the caller falls back to the locked path
+}
+
+void cachePush(threadCache *cache, memoryBlockHeader *block)
+{
+    int binIndex = getSize(block) / 8;
+    setNext(block, cache->bins[binIndex]);
+    cache->bins[binIndex] = block;
+    cache->counts[binIndex]++;
+}
+
+int refillThreadCache(threadCache *cache, size_t blockSize)
+{
+    // carve one region from the shared heap into a batch of blocks, taking the lock once
+    size_t stride = blockSize + BLOCK_OVERHEAD;
+    int count = CACHE_BATCH_BYTES / stride;
+    if (count > CACHE_MAX)
+    {
+        count = CACHE_MAX;
+    }
+    // the carving stays under the lock since coalescing neighbours read these headers and footers
+    lockHeap();
+    unsigned char *region = oldMalloc(count * stride - BLOCK_OVERHEAD);
+    if (region == NULL)
+    {
+        unlockHeap();
+        return 0;
+    }
+    splitRegion(region, blockSize, count);
+    for (int i = 0; i < count; i++)
+    {
+        memoryBlockHeader *block = (memoryBlockHeader *)(region - sizeof(memoryBlockHeader) + i * stride);
+        setOwner(block, cache);
+        if (getSize(block) <= CACHE_LIMIT)
+        {
+            cachePush(cache, block);
+        }
+        else
+        {
+            releaseCachedBlock(block);
+        }
+    }
+    unlockHeap();
+    return 1;
+}
+
+void *cacheMalloc(threadCache *cache, size_t blockSize)
+{
+    // lock free unless the bin is empty and nothing came back from other threads
+    int binIndex = blockSize / 8;
+    checkCacheEpoch(cache);
+    if (cache->bins[binIndex] == NULL)
+    {
+        memoryBlockHeader *block = atomic_exchange(&cache->remoteFrees, NULL);
+        while (block != NULL)
+        {
+            memoryBlockHeader *next = getNext(block);
+            cachePush(cache, block);
+            block = next;
+        }
+    }
+    if (cache->bins[binIndex] == NULL && !refillThreadCache(cache, blockSize))
+    {
+        return NULL;
+    }
+    memoryBlockHeader *block = cache->bins[binIndex];
+    cache->bins[binIndex] = getNext(block);
+    cache->counts[binIndex]--;
+    setNext(block, NULL);
+    addCount(&cache->allocations, 1);
+    addCount(&cache->bytesAllocated, getSize(block));
+    return (unsigned char *)block + sizeof(memoryBlockHeader);
+}
+
+void cacheFree(memoryBlockHeader *block)
+{
+    threadCache *owner = getOwner(block);
+    // count the free against this thread, the owner's counters are not ours to write
+    if (myCache != NULL)
+    {
+        addCount(&myCache->frees, 1);
+        addCount(&myCache->bytesFreed, getSize(block));
+    }
+    else
+    {
+        lockHeap();
+        stats.frees++;
+        stats.bytesFreed += getSize(block);
+        unlockHeap();
+    }
+    if (owner != myCache)
+    {
+        // remote free, push onto the owner's list without taking any lock
+        memoryBlockHeader *head = atomic_load_explicit(&owner->remoteFrees, memory_order_relaxed);
+        do
+        {
+            setNext(block, head);
+        } while (!atomic_compare_exchange_weak(&owner->remoteFrees, &head, block));
+        if (!atomic_load(&owner->inUse))
+        {
+            // the owner has exited and nobody drains its list any more, unless a new thread claimed it meanwhile
+            lockHeap();
+            if (!atomic_load(&owner->inUse))
+            {
+                releaseRemoteFrees(owner);
+            }
+            unlockHeap();
+        }
+        return;
+    }
+    checkCacheEpoch(owner);
+    cachePush(owner, block);
+    int binIndex = getSize(block) / 8;
+    if (owner->counts[binIndex] > CACHE_MAX)
+    {
+        // too many cached, give half back to the shared heap
+        lockHeap();
+        while (owner->counts[binIndex] > CACHE_MAX / 2)
+        {
+            memoryBlockHeader *released = owner->bins[binIndex];
+            owner->bins[binIndex] = getNext(released);
+            owner->counts[binIndex]--;
+            releaseCachedBlock(released);
+        }
+        unlockHeap();
+    }
+}
+
+void *allocateBlock(int size)
+{
+    // duMalloc without the trace
+    size_t blockSize = requestSize(size);
+    threadCache *cache = threadSafe && blockSize <= CACHE_LIMIT ? getThreadCache() : NULL;
+    void *ptr;
+    if (cache != NULL)
+    {
+        ptr = cacheMalloc(cache, blockSize);
+    }
+    else
+    {
+        lockHeap();
+        ptr = oldMalloc(size);
+        if (ptr != NULL)
+        {
+            countAllocation(ptr);
+        }
+        unlockHeap();
+    }
+    return ptr;
+}
+
+void releaseBlock(void *ptr)
+{
+    // duFree without the trace
+    memoryBlockHeader *blockHeader = (memoryBlockHeader *)((unsigned char *)ptr - sizeof(memoryBlockHeader));
+    if (getOwner(blockHeader) != NULL)
+    {
+        cacheFree(blockHeader);
+        return;
+    }
+    lockHeap();
+    countFree(blockHeader);
+    freeBlock(heapIndexOf(blockHeader), blockHeader);
+    unlockHeap();
+}
+
+void *duMalloc(int size)
+{
+    void *ptr = allocateBlock(size);
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        traceAllocation(DU_TRACE_MALLOC, ptr, size, DEFAULT_ALIGNMENT);
+    }
+    return ptr;
+}
+
+void duFree(void *ptr)
+{
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        traceRelease(DU_TRACE_FREE, ptr);
+    }
+    releaseBlock(ptr);
+}
+
+void *duCalloc(int count, int size)
+{
+    if (count < 0 || size < 0 || (size > 0 && count > INT_MAX / size))
+    {
+        return NULL; // the size does not fit in an int
+    }
+    // the old heap and the thread caches hand out reused blocks, so they are always cleared
+    void *ptr = duMalloc(count * size);
+    if (ptr != NULL)
+    {
+        memset(ptr, 0, (size_t)count * size);
+    }
+    return ptr;
+}
+
+void *duMallocAligned(int size, int align)
+{
+    if (align <= 0 || (align & (align - 1)) != 0)
+    {
+        return NULL; // not a power of two
+    }
+    if (align <= DEFAULT_ALIGNMENT)
+    {
+        return duMalloc(size);
+    }
+    // aligned blocks skip the thread caches, whose bins only know sizes
+    lockHeap();
+    void *ptr = oldMallocAligned(requestSize(size), align);
+    if (ptr != NULL)
+    {
+        countAllocation(ptr);
+    }
+    unlockHeap();
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        traceAllocation(DU_TRACE_MALLOC, ptr, size, align);
+    }
+    return ptr;
+}
+
+void *duRealloc(void *ptr, int size)
+{
+    if (ptr == NULL)
+    {
+        return duMalloc(size);
+    }
+    if (size == 0)
+    {
+        duFree(ptr);
+        return NULL;
+    }
+    size_t blockSize = requestSize(size);
+    memoryBlockHeader *blockHeader = (memoryBlockHeader *)((unsigned char *)ptr - sizeof(memoryBlockHeader));
+    void *result = ptr;
+    lockHeap();
+    size_t oldSize = getSize(blockHeader);
+    // a cached block must keep its bin size, so it stays only while the request still fits
+    int inPlace = getOwner(blockHeader) != NULL ? blockSize <= oldSize : resizeInPlace(heapIndexOf(blockHeader), blockHeader, blockSize);
+    if (inPlace)
+    {
+        countResize(oldSize, getSize(blockHeader));
+    }
+    unlockHeap();
+    if (!inPlace)
+    {
+        // move, the old block is left alone when there is no room for the new one
+        result = allocateBlock(size);
+        if (result != NULL)
+        {
+            memcpy(result, ptr, oldSize < blockSize ? oldSize : blockSize);
+        }
+    }
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        // recorded before the old block is freed, so another thread cannot take its address and id first
+        traceResize(DU_TRACE_REALLOC, ptr, result, size);
+    }
+    if (!inPlace && result != NULL)
+    {
+        releaseBlock(ptr);
+    }
+    return result;
+}
+
+int duMallocBatch(int size, int count, void **out)
+{
+    // one region carved into count blocks under a single lock, bypassing the thread caches
+    size_t blockSize = requestSize(size);
+    size_t stride = blockSize + BLOCK_OVERHEAD;
+    int allocated = 0;
+    if (count <= 0)
+    {
+        return 0;
+    }
+    lockHeap();
+    unsigned char *region = spaceMalloc(OLD_HEAP, count * stride - BLOCK_OVERHEAD);
+    if (region != NULL)
+    {
+        splitRegion(region, blockSize, count);
+        for (; allocated < count; allocated++)
+        {
+            out[allocated] = region + allocated * stride;
+            countAllocation(out[allocated]);
+        }
+    }
+    else
+    {
+        // no room for one region, take the blocks wherever they fit
+        for (; allocated < count && (out[allocated] = oldMalloc(size)) != NULL; allocated++)
+        {
+            countAllocation(out[allocated]);
+        }
+    }
+    unlockHeap();
+    for (int i = allocated; i < count; i++)
+    {
+        out[i] = NULL;
+    }
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        // a failure is recorded once, as the call that would have failed
+        for (int i = 0; i < count && i <= allocated; i++)
+        {
+            traceAllocation(DU_TRACE_MALLOC, out[i], size, DEFAULT_ALIGNMENT);
+        }
+    }
+    return allocated;
+}
+
+void duFreeBatch(void **ptrs, int count)
+{
+    // frees in address order, joining blocks that sit next to each other before they reach the free list
+    if (count <= 0)
+    {
+        return;
+    }
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        for (int i = 0; i < count; i++)
+        {
+            traceRelease(DU_TRACE_FREE, ptrs[i]);
+        }
+    }
+    sortAddresses(ptrs, count, compareAddress);
+    // thread cache blocks go back to their caches, which take the lock themselves when needed
+    int shared = 0;
+    for (int i = 0; i < count; i++)
+    {
+        memoryBlockHeader *block = (memoryBlockHeader *)((unsigned char *)ptrs[i] - sizeof(memoryBlockHeader));
+        if (getOwner(block) != NULL)
+        {
+            cacheFree(block);
+        }
+        else
+        {
+            ptrs[shared++] = ptrs[i];
+        }
+    }
+    lockHeap();
+    memoryBlockHeader *first = NULL;
+    memoryBlockHeader *last = NULL;
+    int blocks = 0;
+    for (int i = 0; i < shared; i++)
+    {
+        memoryBlockHeader *block = (memoryBlockHeader *)((unsigned char *)ptrs[i] - sizeof(memoryBlockHeader));
+        countFree(block);
+        if (last != NULL && nextPhysicalBlock(heapIndexOf(last), last) == block)
+        {
+            last = block;
+            blocks++;
+            continue;
+        }
+        if (first != NULL)
+        {
+            freeRun(first, last, blocks);
+        }
+        first = last = block;
+        blocks = 1;
+    }
+    if (first != NULL)
+    {
+        freeRun(first, last, blocks);
+    }
+    unlockHeap();
+}
+
+duPool *duPoolCreate(int objectSize)
+{
+    duPool *pool = duMalloc(sizeof(duPool));
+    if (pool == NULL)
+    {
+        return NULL;
+    }
+    size_t slotSize = objectSize > 0 ? ((size_t)objectSize + 7) & ~(size_t)7 : 8;
+    pool->slotSize = slotSize > sizeof(void *) ? slotSize : sizeof(void *);
+    pool->slabBytes = POOL_SLAB_BYTES;
+    if (pool->slabBytes < sizeof(void *) + POOL_MIN_SLOTS * pool->slotSize)
+    {
+        pool->slabBytes = sizeof(void *) + POOL_MIN_SLOTS * pool->slotSize;
+    }
+    pool->slabs = NULL;
+    pool->freeSlots = NULL;
+    pool->carve = NULL;
+    pool->slabEnd = NULL;
+    return pool;
+}
+
+void *duPoolAlloc(duPool *pool)
+{
+    // reuse the most recently freed slot, otherwise carve the next one, a new slab only when the last is used up
+    void *slot = pool->freeSlots;
+    if (slot != NULL)
+    {
+        pool->freeSlots = *(void **)slot;
+        return slot;
+    }
+    if (pool->carve == NULL || pool->carve + pool->slotSize > pool->slabEnd)
+    {
+        if (pool->slabBytes > INT_MAX)
+        {
+            return NULL;
+        }
+        unsigned char *slab = duMalloc((int)pool->slabBytes);
+        if (slab == NULL)
+        {
+            return NULL;
+        }
+        *(void **)slab = pool->slabs;
+        pool->slabs = slab;
+        pool->carve = slab + sizeof(void *);
+        pool->slabEnd = slab + pool->slabBytes;
+    }
+    slot = pool->carve;
+    pool->carve += pool->slotSize;
+    return slot;
+}
+
+void duPoolFree(duPool *pool, void *object)
+{
+    *(void **)object = pool->freeSlots;
+    pool->freeSlots = object;
+}
+
+void duPoolDestroy(duPool *pool)
+{
+    // every slab goes back to the heap at once, objects still allocated from the pool go with them
+    void *slab = pool->slabs;
+    while (slab != NULL)
+    {
+        void *previous = *(void **)slab;
+        duFree(slab);
+        slab = previous;
+    }
+    duFree(pool);
+}
+
+void *managedStorage(int size, size_t align)
+{
+    // young heap space, or a mapping of its own for a large object, heap lock held
+    if (isLargeRequest(requestSize(size), align))
+    {
+        return largeMalloc(requestSize(size), align);
+    }
+    return heapMalloc(size, align);
+}
+
+void **managedMalloc(int size, const duType *type, size_t align, int zeroed)
+{
+    lockHeap();
+    void **mptr = NULL;
+    // Call the original malloc function
+    allocationZeroed = 0;
+    void *ptr = managedStorage(size, align);
+    if (ptr != NULL && zeroed && !allocationZeroed)
+    {
+        memset(ptr, 0, size);
+    }
+    if (ptr != NULL)
+    {
+        // Add an entry into the Managed List
+        int index = allocateManagedSlot();
+        memoryBlockHeader *blockHeader = (memoryBlockHeader *)((unsigned char *)ptr - sizeof(memoryBlockHeader));
+        if (index < 0)
+        {
+            // Managed List cannot grow any further
+            releaseStorage(blockHeader);
+        }
+        else
+        {
+            managedList[index] = ptr;
+            // Set the managed index in the heap block
+            setManagedIndex(blockHeader, index);
+            managedTypes[index] = type;
+            typedBlockCount += type != NULL;
+            // the collectors read the alignment back when they move the block
+            managedAlignments[index] = align > DEFAULT_ALIGNMENT ? __builtin_ctzll(align) : 0;
+            countAllocation(ptr);
+            mptr = &managedList[index];
+        }
+    }
+    unlockHeap();
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        traceAllocation(DU_TRACE_MANAGED_MALLOC, mptr, size, align);
+    }
+    // Return the pointer to the Managed List slot, NULL if allocation failed
+    return mptr;
+}
+
+void **duManagedMallocTyped(int size, const duType *type)
+{
+    return managedMalloc(size, type, DEFAULT_ALIGNMENT, 0);
+}
+
+void **duManagedMalloc(int size)
+{
+    return managedMalloc(size, NULL, DEFAULT_ALIGNMENT, 0);
+}
+
+void **duManagedCalloc(int count, int size)
+{
+    if (count < 0 || size < 0 || (size > 0 && count > INT_MAX / size))
+    {
+        return NULL; // the size does not fit in an int
+    }
+    return managedMalloc(count * size, NULL, DEFAULT_ALIGNMENT, 1);
+}
+
+void **duManagedMallocAligned(int size, int align)
+{
+    if (align <= 0 || (align & (align - 1)) != 0)
+    {
+        return NULL; // not a power of two
+    }
+    return managedMalloc(size, NULL, align > DEFAULT_ALIGNMENT ? align : DEFAULT_ALIGNMENT, 0);
+}
+
+void duManagedFree(void **mptr)
+{
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        traceRelease(DU_TRACE_MANAGED_FREE, mptr);
+    }
+    lockHeap();
+    // Check if the Managed List slot is already vacated
+    if (!SLOT_IN_USE(*mptr))
+    {
+        unlockHeap();
+        return; // Pointer has already been freed
+    }
+    // Call the original free function to remove the block from the heap it lives in
+    memoryBlockHeader *blockHeader = (memoryBlockHeader *)((unsigned char *)*mptr - sizeof(memoryBlockHeader));
+    countFree(blockHeader);
+    releaseStorage(blockHeader);
+    // Vacate the slot in the Managed List so the next duManagedMalloc can reuse it
+    releaseManagedSlot(mptr - managedList);
+    unlockHeap();
+}
+
+void **duManagedRealloc(void **mptr, int size)
+{
+    if (mptr == NULL)
+    {
+        return duManagedMalloc(size);
+    }
+    if (size == 0)
+    {
+        duManagedFree(mptr);
+        return NULL;
+    }
+    size_t blockSize = requestSize(size);
+    void **result = mptr;
+    lockHeap();
+    if (!SLOT_IN_USE(*mptr))
+    {
+        unlockHeap();
+        return NULL; // the handle was freed
+    }
+    int index = mptr - managedList;
+    memoryBlockHeader *blockHeader = (memoryBlockHeader *)((unsigned char *)*mptr - sizeof(memoryBlockHeader));
+    size_t oldSize = getSize(blockHeader);
+    int inPlace;
+    if (isLargeObject(blockHeader) != isLargeRequest(blockSize, slotAlignment(index)))
+    {
+        inPlace = 0; // crossing the threshold moves the block between the young heap and the large object space
+    }
+    else if (isLargeObject(blockHeader))
+    {
+        memoryBlockHeader *remapped = largeResize(blockHeader, blockSize);
+        inPlace = remapped != NULL;
+        if (remapped != NULL)
+        {
+            managedList[index] = (unsigned char *)remapped + sizeof(memoryBlockHeader);
+            blockHeader = remapped;
+        }
+    }
+    else
+    {
+        // a block waiting to be evacuated can only shrink, its heap is no longer allocated from
+        inPlace = inIncrementalFrom(blockHeader) ? blockSize <= oldSize : resizeInPlace(heapIndexOf(blockHeader), blockHeader, blockSize);
+    }
+    if (inPlace)
+    {
+        countResize(oldSize, getSize(blockHeader));
+    }
+    else
+    {
+        // the allocation may collect, so pin the block and re-read its slot afterwards
+        void **pinned = mptr;
+        pushRoot(&pinned);
+        void *ptr = managedStorage(size, slotAlignment(index));
+        popRoot(&pinned);
+        if (ptr == NULL)
+        {
+            result = NULL;
+        }
+        else
+        {
+            memoryBlockHeader *oldBlock = (memoryBlockHeader *)((unsigned char *)managedList[index] - sizeof(memoryBlockHeader));
+            memoryBlockHeader *newBlock = (memoryBlockHeader *)((unsigned char *)ptr - sizeof(memoryBlockHeader));
+            memcpy(ptr, managedList[index], getSize(oldBlock) < blockSize ? getSize(oldBlock) : blockSize);
+            setManagedIndex(newBlock, index);
+            setAge(newBlock, getAge(oldBlock));
+            managedList[index] = ptr;
+            countAllocation(ptr);
+            countFree(oldBlock);
+            releaseStorage(oldBlock);
+        }
+    }
+    unlockHeap();
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        traceResize(DU_TRACE_MANAGED_REALLOC, mptr, result, size);
+    }
+    // the same handle, or NULL with the block untouched when it could not grow
+    return result;
+}
+
+int duManagedMallocBatch(int size, int count, void ***out)
+{
+    // one young region carved into count managed blocks, a single collection check covers them all
+    size_t blockSize = requestSize(size);
+    size_t stride = blockSize + BLOCK_OVERHEAD;
+    size_t regionSize = count * stride - BLOCK_OVERHEAD;
+    int allocated = 0;
+    if (count <= 0)
+    {
+        return 0;
+    }
+    lockHeap();
+    // large objects each need a mapping of their own, so they take the one at a time path below
+    unsigned char *region = regionSize <= INT_MAX && !isLargeRequest(blockSize, DEFAULT_ALIGNMENT) ? heapMalloc((int)regionSize, DEFAULT_ALIGNMENT) : NULL;
+    if (region != NULL)
+    {
+        splitRegion(region, blockSize, count);
+        for (; allocated < count; allocated++)
+        {
+            int index = allocateManagedSlot();
+            if (index < 0)
+            {
+                // Managed List cannot grow any further, the rest of the region goes back in one piece
+                memoryBlockHeader *first = (memoryBlockHeader *)(region + allocated * stride - sizeof(memoryBlockHeader));
+                memoryBlockHeader *last = (memoryBlockHeader *)(region + (count - 1) * stride - sizeof(memoryBlockHeader));
+                freeRun(first, last, count - allocated);
+                break;
+            }
+            managedList[index] = region + allocated * stride;
+            setManagedIndex((memoryBlockHeader *)(region + allocated * stride - sizeof(memoryBlockHeader)), index);
+            countAllocation(managedList[index]);
+            out[allocated] = &managedList[index];
+        }
+    }
+    unlockHeap();
+    if (region == NULL)
+    {
+        // no room for one region, handles stay valid however often the blocks move
+        for (; allocated < count && (out[allocated] = duManagedMalloc(size)) != NULL; allocated++)
+        {
+        }
+        for (int i = allocated; i < count; i++)
+        {
+            out[i] = NULL;
+        }
+        return allocated;
+    }
+    for (int i = allocated; i < count; i++)
+    {
+        out[i] = NULL;
+    }
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        for (int i = 0; i < count && i <= allocated; i++)
+        {
+            traceAllocation(DU_TRACE_MANAGED_MALLOC, out[i], size, DEFAULT_ALIGNMENT);
+        }
+    }
+    return allocated;
+}
+
+void duManagedFreeBatch(void ***mptrs, int count)
+{
+    // like duFreeBatch, handles are ordered by the address of their blocks
+    if (count <= 0)
+    {
+        return;
+    }
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        for (int i = 0; i < count; i++)
+        {
+            traceRelease(DU_TRACE_MANAGED_FREE, mptrs[i]);
+        }
+    }
+    lockHeap();
+    // already freed handles are skipped, and freeing the same handle twice in one batch frees it once
+    int live = 0;
+    for (int i = 0; i < count; i++)
+    {
+        if (SLOT_IN_USE(*mptrs[i]))
+        {
+            mptrs[live++] = mptrs[i];
+        }
+    }
+    sortAddresses((void **)mptrs, live, compareManagedAddress);
+    memoryBlockHeader *first = NULL;
+    memoryBlockHeader *last = NULL;
+    int blocks = 0;
+    for (int i = 0; i < live; i++)
+    {
+        if (i > 0 && mptrs[i] == mptrs[i - 1])
+        {
+            continue;
+        }
+        memoryBlockHeader *block = (memoryBlockHeader *)((unsigned char *)*mptrs[i] - sizeof(memoryBlockHeader));
+        countFree(block);
+        releaseManagedSlot(mptrs[i] - managedList);
+        if (isLargeObject(block) || inIncrementalFrom(block))
+        {
+            releaseStorage(block);
+            continue;
+        }
+        if (last != NULL && nextPhysicalBlock(heapIndexOf(last), last) == block)
+        {
+            last = block;
+            blocks++;
+            continue;
+        }
+        if (first != NULL)
+        {
+            freeRun(first, last, blocks);
+        }
+        first = last = block;
+        blocks = 1;
+    }
+    if (first != NULL)
+    {
+        freeRun(first, last, blocks);
+    }
+    unlockHeap();
+}
+
+unsigned int duManagedGeneration(void **mptr)
+{
+    lockHeap();
+    unsigned int generation = managedGenerations[mptr - managedList];
+    unlockHeap();
+    return generation;
+}
+
+int duManagedValid(void **mptr, unsigned int generation)
+{
+    // a handle is stale once its slot has been freed, even if the slot was handed out again
+    lockHeap();
+    int valid = SLOT_IN_USE(*mptr) && managedGenerations[mptr - managedList] == generation;
+    unlockHeap();
+    return valid;
+}
+
+int duCollectStep(int budgetMicros)
+{
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        traceCall(DU_TRACE_STEP, 0, budgetMicros);
+    }
+    lockHeap();
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    size_t bytesCopied = 0;
+    if (incrementalFrom < 0)
+    {
+        startIncrementalCycle();
+    }
+    int more = incrementalStep(budgetMicros, &start, &bytesCopied);
+    recordCollection(&start, bytesCopied);
+    unlockHeap();
+    return more;
+}
+
+void minorCollection()
+{
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        traceCall(DU_TRACE_MINOR, 0, 0);
+    }
+    lockHeap();
+    evacuateYoungHeap();
+    unlockHeap();
+}
+
+void majorCollection()
+{
+    if (atomic_load_explicit(&tracing, memory_order_relaxed))
+    {
+        traceCall(DU_TRACE_MAJOR, 0, 0);
+    }
+    lockHeap();
+    struct timespec pauseStart;
+    clock_gettime(CLOCK_MONOTONIC, &pauseStart);
+    size_t bytesCopied = 0;
+    if (typedBlockCount > 0)
+    {
+        reclaimUnreachable(-1);
+    }
+    // Slide every managed block in the old heap down over the free space before it
+    // unmanaged blocks are pinned since raw pointers to them cannot be updated
+    unsigned char *start = heap[OLD_HEAP];
+    unsigned char *end = start + heapSize[OLD_HEAP];
+    unsigned char *compactPointer = start;
+    initFreeList(OLD_HEAP, NULL);
+    unsigned char *current = start;
+    while (current < end)
+    {
+        memoryBlockHeader *block = (memoryBlockHeader *)current;
+        size_t blockSize = getSize(block);
+        unsigned char *next = current + BLOCK_OVERHEAD + blockSize;
+        if (!isFree(block))
+        {
+            int index = getManagedIndex(block);
+            // an aligned block slides only as far as keeps it aligned, with the gap in front free
+            // and never so far that the gap left behind becomes too small to be a free block
+            size_t gap = current - compactPointer;
+            size_t pad = index >= 0 ? alignmentPadding(compactPointer, slotAlignment(index)) : 0;
+            if (index >= 0 && pad <= gap && (gap - pad == 0 || gap - pad >= MIN_BLOCK))
+            {
+                if (pad > 0)
+                {
+                    setBlock((memoryBlockHeader *)compactPointer, pad - BLOCK_OVERHEAD, FREE);
+                    freeListInsert(OLD_HEAP, (memoryBlockHeader *)compactPointer);
+                    markGranules(OLD_HEAP, compactPointer, pad, FREE);
+                    compactPointer += pad;
+                }
+                if (current != compactPointer)
+                {
+                    int age = getAge(block);
+                    memoryBlockHeader *moved = (memoryBlockHeader *)compactPointer;
+                    memmove(compactPointer + sizeof(memoryBlockHeader), current + sizeof(memoryBlockHeader), blockSize);
+                    bytesCopied += blockSize;
+                    setBlock(moved, blockSize, USED);
+                    setManagedIndex(moved, index);
+                    setAge(moved, age);
+                    managedList[index] = compactPointer + sizeof(memoryBlockHeader);
+                }
+            }
+            else
+            {
+                // the gap left in front of a block that stays put becomes a free block
+                if (current != compactPointer)
+                {
+                    setBlock((memoryBlockHeader *)compactPointer, current - compactPointer - BLOCK_OVERHEAD, FREE);
+                    freeListInsert(OLD_HEAP, (memoryBlockHeader *)compactPointer);
+                    markGranules(OLD_HEAP, compactPointer, current - compactPointer, FREE);
+                }
+                compactPointer = current;
+            }
+            compactPointer += BLOCK_OVERHEAD + blockSize;
+        }
+        current = next;
+    }
+    // and everything after the last survivor is one free block
+    if (compactPointer != end)
+    {
+        setBlock((memoryBlockHeader *)compactPointer, end - compactPointer - BLOCK_OVERHEAD, FREE);
+        freeListInsert(OLD_HEAP, (memoryBlockHeader *)compactPointer);
+        markGranules(OLD_HEAP, compactPointer, end - compactPointer, FREE);
+    }
+    stats.majorCollections++;
+    recordCollection(&pauseStart, bytesCopied);
+    unlockHeap();
+}
+
+// Heap snapshots, the file starts with a heapImage padded to a page, then holds the old heap so it can be
+// mapped straight in, the young heap up to its end or bump pointer, a savedSlot per Managed List slot,
+// the types as handle counts followed by their offsets, and the payload of each large object in slot order
+#define HEAP_IMAGE_MAGIC "DUHEAP01"
+#define SAVED_VACANT 0
+#define SAVED_YOUNG 1
+#define SAVED_OLD 2
+#define SAVED_LARGE 3
+
+typedef struct heapImage
+{
+    char magic[8];
+    unsigned int layout;  // sizeof(memoryBlockHeader), a snapshot only loads into a build with the same blocks
+    int strategy;         // including THREAD_SAFE
+    size_t youngSize;
+    size_t oldSize;
+    size_t youngBytes;    // bytes of the young heap saved, everything before the bump pointer while bumping
+    int bumping;
+    int slotCount;
+    int typeCount;
+    int typeFields;       // handle offsets of all the types together
+    uintptr_t listBase;   // address the Managed List had, handles in typed blocks are relative to it
+    size_t fileBytes;
+} heapImage;
+
+typedef struct savedSlot
+{
+    unsigned long long offset; // of the payload from its heap's base, the payload size for a large object
+    unsigned int generation;
+    int type;                  // index into the saved types, -1 when untyped
+    unsigned char where;       // SAVED_VACANT, SAVED_YOUNG, SAVED_OLD or SAVED_LARGE
+    unsigned char alignment;   // as in managedAlignments
+    unsigned char age;
+} savedSlot;
+
+int savedTypeIndex(const duType **types, int *typeCount, const duType *type)
+{
+    // number the distinct types in the order they are met, there are only ever a handful
+    if (type == NULL)
+    {
+        return -1;
+    }
+    for (int i = 0; i < *typeCount; i++)
+    {
+        if (types[i] == type)
+        {
+            return i;
+        }
+    }
+    types[*typeCount] = type;
+    return (*typeCount)++;
+}
+
+int writeHeapImage(FILE *file)
+{
+    // heap lock held, 0 on a write error
+    heapImage image;
+    memset(&image, 0, sizeof(image));
+    memcpy(image.magic, HEAP_IMAGE_MAGIC, 8);
+    image.layout = sizeof(memoryBlockHeader);
+    image.strategy = allocationStrategy | (threadSafe ? THREAD_SAFE : 0);
+    image.youngSize = heapSize[currentHeapIndex];
+    image.oldSize = heapSize[OLD_HEAP];
+    image.bumping = bumpPointer[currentHeapIndex] != NULL;
+    image.youngBytes = image.bumping ? (size_t)(bumpPointer[currentHeapIndex] - heap[currentHeapIndex]) : heapSize[currentHeapIndex];
+    image.slotCount = managedListSize;
+    image.listBase = (uintptr_t)managedList;
+    savedSlot *slots = calloc(managedListSize + 1, sizeof(savedSlot));
+    const duType **types = malloc((managedListSize + 1) * sizeof(duType *));
+    if (slots == NULL || types == NULL)
+    {
+        free(slots);
+        free(types);
+        return 0;
+    }
+    size_t largeBytes = 0;
+    for (int i = 0; i < managedListSize; i++)
+    {
+        savedSlot *slot = &slots[i];
+        slot->generation = managedGenerations[i];
+        slot->type = -1;
+        if (!SLOT_IN_USE(managedList[i]))
+        {
+            continue;
+        }
+        memoryBlockHeader *block = (memoryBlockHeader *)((unsigned char *)managedList[i] - sizeof(memoryBlockHeader));
+        int heapIndex = heapIndexOf(block);
+        if (heapIndex < 0)
+        {
+            slot->where = SAVED_LARGE;
+            slot->offset = getSize(block);
+            largeBytes += getSize(block);
+        }
+        else
+        {
+            slot->where = heapIndex == OLD_HEAP ? SAVED_OLD : SAVED_YOUNG;
+            slot->offset = (unsigned char *)managedList[i] - heap[heapIndex];
+        }
+        slot->alignment = managedAlignments[i];
+        slot->age = getAge(block);
+        int typeCount = image.typeCount;
+        slot->type = savedTypeIndex(types, &image.typeCount, managedTypes[i]);
+        if (image.typeCount > typeCount)
+        {
+            image.typeFields += managedTypes[i]->handleCount;
+        }
+    }
+    image.fileBytes = HEAP_PAGE + roundToPage(image.oldSize) + image.youngBytes + managedListSize * sizeof(savedSlot) +
+                      (image.typeCount + image.typeFields) * sizeof(int) + largeBytes;
+    // the old heap starts a page in, after the header and its padding
+    static const unsigned char zeroes[HEAP_PAGE];
+    int written = fwrite(&image, sizeof(image), 1, file) == 1 &&
+                  fwrite(zeroes, HEAP_PAGE - sizeof(image), 1, file) == 1 &&
+                  fwrite(heap[OLD_HEAP], roundToPage(image.oldSize), 1, file) == 1 &&
+                  fwrite(heap[currentHeapIndex], 1, image.youngBytes, file) == image.youngBytes &&
+                  fwrite(slots, sizeof(savedSlot), managedListSize, file) == (size_t)managedListSize;
+    for (int i = 0; written && i < image.typeCount; i++)
+    {
+        written = fwrite(&types[i]->handleCount, sizeof(int), 1, file) == 1 &&
+                  fwrite(types[i]->handleOffsets, sizeof(int), types[i]->handleCount, file) == (size_t)types[i]->handleCount;
+    }
+    for (int i = 0; written && i < managedListSize; i++)
+    {
+        if (slots[i].where == SAVED_LARGE)
+        {
+            written = fwrite(managedList[i], 1, slots[i].offset, file) == slots[i].offset;
+        }
+    }
+    free(slots);
+    free(types);
+    return written;
+}
+
+int duHeapSave(const char *path)
+{
+    // written next to path and renamed over it, so a heap still mapped from path keeps its pages
+    size_t length = strlen(path);
+    char *tempPath = malloc(length + 5);
+    if (tempPath == NULL)
+    {
+        return 0;
+    }
+    memcpy(tempPath, path, length);
+    memcpy(tempPath + length, ".tmp", 5);
+    FILE *file = fopen(tempPath, "wb");
+    if (file == NULL)
+    {
+        free(tempPath);
+        return 0;
+    }
+    lockHeap();
+    // the young heap being evacuated would have to be saved as well
+    finishIncrementalCycle();
+    int written = writeHeapImage(file);
+    unlockHeap();
+    written = fclose(file) == 0 && written;
+    if (!written || rename(tempPath, path) != 0)
+    {
+        remove(tempPath);
+        written = 0;
+    }
+    free(tempPath);
+    return written;
+}
+
+void addFreeSpace(int heapIndex, unsigned char *from, unsigned char *to)
+{
+    setBlock((memoryBlockHeader *)from, to - from - BLOCK_OVERHEAD, FREE);
+    freeListInsert(heapIndex, (memoryBlockHeader *)from);
+    markGranules(heapIndex, from, to - from, FREE);
+}
+
+unsigned char *reviveHeap(int heapIndex, unsigned char *end, int *revived)
+{
+    // one pass over a loaded heap, rebuilding its free list
+    // blocks the Managed List points back at stay, everything else between them becomes free space:
+    // free blocks, unmanaged blocks nothing points to any more, cached blocks and alignment pads
+    // returns where the free space at the end starts, end when the last block stays, NULL if a block runs past end
+    initFreeList(heapIndex, NULL);
+    unsigned char *gap = NULL;
+    unsigned char *current = heap[heapIndex];
+    while (current < end)
+    {
+        memoryBlockHeader *block = (memoryBlockHeader *)current;
+        if ((size_t)(end - current) < BLOCK_OVERHEAD || getSize(block) % 8 != 0 || getSize(block) > (size_t)(end - current) - BLOCK_OVERHEAD)
+        {
+            return NULL;
+        }
+        unsigned char *next = current + BLOCK_OVERHEAD + getSize(block);
+        int index = isFree(block) ? -1 : getManagedIndex(block);
+        if (index >= 0 && index < managedListSize && managedList[index] == current + sizeof(memoryBlockHeader))
+        {
+            if (gap != NULL)
+            {
+                addFreeSpace(heapIndex, gap, current);
+                gap = NULL;
+            }
+            setOwner(block, NULL);
+            stats.bytesAllocated += getSize(block);
+            (*revived)++;
+        }
+        else if (gap == NULL)
+        {
+            gap = current;
+        }
+        current = next;
+    }
+    return gap != NULL ? gap : end;
+}
+
+int readHeapImage(FILE *file, heapImage *image)
+{
+    // heap lock held, the heap has been initialized to the snapshot's young size, 0 if the file is cut short
+    // both heaps are read into fresh pages, so the loaded heap never reads from the file again
+    size_t oldMapped = roundToPage(image->oldSize);
+    if (image->oldSize > heapReserve || !mapRegion(heap[OLD_HEAP], heapMapped[OLD_HEAP], oldMapped) ||
+        !mapRegion((unsigned char *)heapBitmap[OLD_HEAP], roundToPage(heapMapped[OLD_HEAP] / 64), roundToPage(oldMapped / 64)))
+    {
+        return 0;
+    }
+    heapSize[OLD_HEAP] = image->oldSize;
+    heapMapped[OLD_HEAP] = oldMapped > heapMapped[OLD_HEAP] ? oldMapped : heapMapped[OLD_HEAP];
+    if (fseek(file, HEAP_PAGE, SEEK_SET) != 0 || fread(heap[OLD_HEAP], 1, image->oldSize, file) != image->oldSize)
+    {
+        return 0;
+    }
+    savedSlot *slots = malloc((image->slotCount + 1) * sizeof(savedSlot));
+    loadedTypes = malloc((image->typeCount + 1) * sizeof(duType) + (image->typeFields + 1) * sizeof(int));
+    if (slots == NULL || loadedTypes == NULL ||
+        fseek(file, HEAP_PAGE + oldMapped, SEEK_SET) != 0 ||
+        fread(heap[currentHeapIndex], 1, image->youngBytes, file) != image->youngBytes ||
+        fread(slots, sizeof(savedSlot), image->slotCount, file) != (size_t)image->slotCount)
+    {
+        free(slots);
+        return 0;
+    }
+    untouched[currentHeapIndex] = heap[currentHeapIndex] + image->youngBytes;
+    int *offsets = (int *)(loadedTypes + image->typeCount + 1);
+    for (int i = 0; i < image->typeCount; i++)
+    {
+        duType *type = &loadedTypes[i];
+        type->handleOffsets = offsets;
+        if (fread(&type->handleCount, sizeof(int), 1, file) != 1 || type->handleCount < 0 ||
+            offsets + type->handleCount > (int *)(loadedTypes + image->typeCount + 1) + image->typeFields ||
+            fread(offsets, sizeof(int), type->handleCount, file) != (size_t)type->handleCount)
+        {
+            free(slots);
+            return 0;
+        }
+        offsets += type->handleCount;
+    }
+    // the Managed List comes back slot for slot, the vacated slots chained lowest first
+    while (managedListCapacity < image->slotCount)
+    {
+        if (!growManagedList())
+        {
+            free(slots);
+            return 0;
+        }
+    }
+    managedListSize = image->slotCount;
+    for (int i = managedListSize - 1; i >= 0; i--)
+    {
+        savedSlot *slot = &slots[i];
+        // an offset outside its heap or a size past the end of the file means the snapshot is corrupt
+        size_t heapBytes = slot->where == SAVED_OLD ? image->oldSize : image->youngBytes;
+        if (slot->where > SAVED_LARGE || slot->type < -1 || slot->type >= image->typeCount || slot->alignment >= sizeof(int) * 8 - 1 ||
+            ((slot->where == SAVED_OLD || slot->where == SAVED_YOUNG) && (slot->offset < sizeof(memoryBlockHeader) || slot->offset >= heapBytes)) ||
+            (slot->where == SAVED_LARGE && slot->offset > image->fileBytes))
+        {
+            free(slots);
+            return 0;
+        }
+        managedGenerations[i] = slot->generation;
+        managedAlignments[i] = slot->alignment;
+        managedTypes[i] = slot->type >= 0 ? &loadedTypes[slot->type] : NULL;
+        typedBlockCount += managedTypes[i] != NULL;
+        if (slot->where == SAVED_OLD)
+        {
+            managedList[i] = heap[OLD_HEAP] + slot->offset;
+        }
+        else if (slot->where == SAVED_YOUNG)
+        {
+            managedList[i] = heap[currentHeapIndex] + slot->offset;
+        }
+        else if (slot->where == SAVED_LARGE)
+        {
+            managedList[i] = NULL; // filled in below
+        }
+        else
+        {
+            managedList[i] = NULL;
+            managedNextFree[i] = managedFreeSlot;
+            managedFreeSlot = i;
+        }
+    }
+    int complete = 1;
+    for (int i = 0; complete && i < managedListSize; i++)
+    {
+        if (slots[i].where != SAVED_LARGE)
+        {
+            continue;
+        }
+        size_t align = slotAlignment(i);
+        void *ptr = largeMalloc(slots[i].offset, align > DEFAULT_ALIGNMENT ? align : DEFAULT_ALIGNMENT);
+        complete = ptr != NULL && fread(ptr, 1, slots[i].offset, file) == slots[i].offset;
+        if (complete)
+        {
+            memoryBlockHeader *block = (memoryBlockHeader *)((unsigned char *)ptr - sizeof(memoryBlockHeader));
+            setManagedIndex(block, i);
+            setAge(block, slots[i].age);
+            stats.bytesAllocated += getSize(block);
+            managedList[i] = ptr;
+        }
+    }
+    free(slots);
+    return complete;
+}
+
+int reviveHeaps(heapImage *image)
+{
+    // heap lock held, turn the loaded images back into working heaps, 0 if they are corrupt or a block cannot be realigned
+    int revived = 0;
+    unsigned char *oldEnd = heap[OLD_HEAP] + heapSize[OLD_HEAP];
+    unsigned char *oldFree = reviveHeap(OLD_HEAP, oldEnd, &revived);
+    if (oldFree == NULL)
+    {
+        return 0;
+    }
+    if (oldFree != oldEnd)
+    {
+        addFreeSpace(OLD_HEAP, oldFree, oldEnd);
+    }
+    // a young heap that was bumping keeps bumping from after its last block, unless holes turned up
+    unsigned char *youngEnd = heap[currentHeapIndex] + heapSize[currentHeapIndex];
+    unsigned char *youngFree = reviveHeap(currentHeapIndex, heap[currentHeapIndex] + image->youngBytes, &revived);
+    if (youngFree == NULL)
+    {
+        return 0;
+    }
+    // every handle into the heaps has to have found the block it names
+    int heapHandles = 0;
+    for (int i = 0; i < managedListSize; i++)
+    {
+        heapHandles += SLOT_IN_USE(managedList[i]) && heapIndexOf(managedList[i]) >= 0;
+    }
+    if (heapHandles != revived)
+    {
+        return 0;
+    }
+    bumpPointer[currentHeapIndex] = NULL;
+    if (image->bumping && freeBlockCount[currentHeapIndex] == 0)
+    {
+        bumpPointer[currentHeapIndex] = youngFree;
+    }
+    else if (youngFree != youngEnd)
+    {
+        addFreeSpace(currentHeapIndex, youngFree, youngEnd);
+    }
+    for (int i = 0; i < managedListSize; i++)
+    {
+        if (!SLOT_IN_USE(managedList[i]))
+        {
+            continue;
+        }
+        // handles in typed blocks still hold addresses in the old Managed List
+        const duType *type = managedTypes[i];
+        memoryBlockHeader *block = (memoryBlockHeader *)((unsigned char *)managedList[i] - sizeof(memoryBlockHeader));
+        for (int f = 0; type != NULL && f < type->handleCount; f++)
+        {
+            if (type->handleOffsets[f] < 0 || (size_t)type->handleOffsets[f] + sizeof(void *) > getSize(block))
+            {
+                return 0;
+            }
+            void **handle;
+            memcpy(&handle, (unsigned char *)managedList[i] + type->handleOffsets[f], sizeof(handle));
+            if (handle != NULL)
+            {
+                uintptr_t distance = (uintptr_t)handle - image->listBase;
+                int valid = distance % sizeof(void *) == 0 && distance / sizeof(void *) < (size_t)managedListSize;
+                handle = valid ? &managedList[distance / sizeof(void *)] : NULL;
+                memcpy((unsigned char *)managedList[i] + type->handleOffsets[f], &handle, sizeof(handle));
+            }
+        }
+        // the heaps are only page aligned, a block aligned beyond that may have to move
+        size_t align = slotAlignment(i);
+        int heapIndex = heapIndexOf(block);
+        if (heapIndex < 0 || ((uintptr_t)managedList[i] & (align - 1)) == 0)
+        {
+            continue;
+        }
+        size_t bytesCopied = 0;
+        if (!promoteBlock(i, block, getAge(block), &bytesCopied) &&
+            !(growHeap(OLD_HEAP, getSize(block) + BLOCK_OVERHEAD + alignmentSlack(align)) && promoteBlock(i, block, getAge(block), &bytesCopied)))
+        {
+            return 0;
+        }
+        freeBlock(heapIndex, block);
+    }
+    return 1;
+}
+
+int validHeapImage(heapImage *image, size_t fileBytes)
+{
+    // the header is checked before anything is reserved or read on its word, every section has to fit the file
+    return memcmp(image->magic, HEAP_IMAGE_MAGIC, 8) == 0 && image->layout == sizeof(memoryBlockHeader) && image->fileBytes == fileBytes &&
+           (image->strategy & ~THREAD_SAFE) >= FIRST_FIT && (image->strategy & ~THREAD_SAFE) <= BITMAP_FIT &&
+           image->youngSize >= MIN_BLOCK && image->youngSize <= HEAP_RESERVE && image->youngSize % 8 == 0 && image->youngBytes <= image->youngSize &&
+           image->oldSize >= MIN_BLOCK && image->oldSize <= fileBytes && image->oldSize % 8 == 0 &&
+           image->slotCount >= 0 && image->typeCount >= 0 && image->typeCount <= image->slotCount &&
+           image->typeFields >= 0 && (size_t)image->typeFields <= fileBytes / sizeof(int) &&
+           HEAP_PAGE + roundToPage(image->oldSize) + image->youngBytes + (size_t)image->slotCount * sizeof(savedSlot) +
+                   ((size_t)image->typeCount + image->typeFields) * sizeof(int) <= fileBytes;
+}
+
+int duHeapLoad(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        return 0;
+    }
+    heapImage image;
+    struct stat status;
+    if (fread(&image, sizeof(image), 1, file) != 1 || fstat(fileno(file), &status) != 0 || !validHeapImage(&image, status.st_size))
+    {
+        fclose(file);
+        return 0;
+    }
+    duInitMallocSize(image.strategy, image.youngSize);
+    lockHeap();
+    int loaded = readHeapImage(file, &image) && reviveHeaps(&image);
+    unlockHeap();
+    fclose(file);
+    if (!loaded)
+    {
+        duInitMallocSize(image.strategy, image.youngSize);
+    }
+    return loaded;
+}
+
+int duManagedIndex(void **mptr)
+{
+    return mptr - managedList;
+}
+
+void **duManagedHandle(int index)
+{
+    lockHeap();
+    void **mptr = index >= 0 && index < managedListSize && SLOT_IN_USE(managedList[index]) ? &managedList[index] : NULL;
+    unlockHeap();
+    return mptr;
+}
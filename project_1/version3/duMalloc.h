@@ -1,18 +1,147 @@
 #ifndef DUMALLOC_H
 #define DUMALLOC_H
+#include <stddef.h>
 #define FIRST_FIT 0
 #define BEST_FIT 1
+#define SEGREGATED_FIT 2
+#define BITMAP_FIT 3 // first fit found by scanning a bitmap of free 8 byte granules
+#define THREAD_SAFE 0x100 // or into the strategy to lock the heap and give each thread a small block cache
 #define Managed(p) (*p)
 #define Managed_t(t) t*
+
+// Counters returned by duGetStats, everything except allocations restarts at init
+typedef struct duStats
+{
+    size_t bytesAllocated;   // block bytes handed out by duMalloc and duManagedMalloc
+    size_t bytesFreed;       // block bytes given back by duFree and duManagedFree
+    size_t liveBytes;        // bytesAllocated - bytesFreed
+    size_t allocations[4];   // allocations made under each strategy, kept across re-inits
+    size_t frees;
+    size_t freeBlocks;       // free list length of the current young heap and the old heap
+    size_t freeBytes;        // bytes those free blocks and the bump space hold
+    size_t largestFreeBlock; // largest allocation either heap can serve without growing
+    size_t minorCollections;
+    size_t majorCollections;
+    size_t blocksReclaimed;  // typed managed blocks freed by a collection because nothing reached them
+    size_t largeObjects;     // managed blocks living in mappings of their own
+    size_t largeObjectBytes; // bytes those mappings take
+    size_t bytesReleased;    // evacuated young heap pages given back to the system
+    size_t lastBytesCopied;  // bytes moved by the last collection of either kind
+    size_t totalBytesCopied;
+    double lastPauseMicros;  // time the last collection held the heap
+    double maxPauseMicros;
+    double totalPauseMicros;
+} duStats;
+
+// Trace files start with DU_TRACE_MAGIC followed by duTraceEvent records
+#define DU_TRACE_MAGIC "DUTRACE2"
+#define DU_TRACE_INIT 0           // uses strategy and heapSize instead of id and size
+#define DU_TRACE_MALLOC 1
+#define DU_TRACE_FREE 2
+#define DU_TRACE_MANAGED_MALLOC 3
+#define DU_TRACE_MANAGED_FREE 4
+#define DU_TRACE_MINOR 5
+#define DU_TRACE_MAJOR 6
+#define DU_TRACE_STEP 7           // size is the budget in microseconds
+#define DU_TRACE_REALLOC 8        // id keeps naming the block after it moves
+#define DU_TRACE_MANAGED_REALLOC 9
+#define DU_TRACE_ALIGN 10         // size is the alignment of the allocation that follows
+typedef struct duTraceEvent
+{
+    unsigned long long time : 56; // nanoseconds since duTraceStart
+    unsigned long long op : 8;
+    union
+    {
+        struct
+        {
+            unsigned int id;      // numbers each block or handle from 1, 0 for a failed allocation
+            unsigned int size;    // requested bytes
+        };
+        struct
+        {
+            unsigned long long strategy : 16; // passed to init
+            unsigned long long heapSize : 48; // size the heap was initialised with
+        };
+    };
+} duTraceEvent;
+
 // The interface for DU malloc and free
 void duInitMalloc(int strategy);
+void duInitMallocSize(int strategy, size_t heapSize); // heaps start at heapSize bytes and grow on demand
 void* duMalloc(int size);
 void duFree(void* ptr);
+void* duCalloc(int count, int size); // zeroed, NULL when count * size does not fit in an int
+// payload on a multiple of align, a power of two, NULL if it is not one, free with duFree
+void* duMallocAligned(int size, int align);
+// grows into a free neighbour or shrinks by freeing the tail, and moves only when it cannot
+// returns NULL and leaves ptr alone when there is no room, a NULL ptr mallocs and size 0 frees
+// a block from duMallocAligned keeps its alignment only while it stays in place
+void* duRealloc(void* ptr, int size);
+// count blocks of size bytes carved from one region, returns how many were allocated, the rest of out is NULL
+int duMallocBatch(int size, int count, void** out);
+void duFreeBatch(void** ptrs, int count); // sorts ptrs by address in place
+// Pools of equal sized objects packed into slabs taken with duMalloc, O(1) and no per object header
+// a pool is not locked, share one between threads only under your own lock
+typedef struct duPool duPool;
+duPool* duPoolCreate(int objectSize);
+void* duPoolAlloc(duPool* pool);
+void duPoolFree(duPool* pool, void* object);
+void duPoolDestroy(duPool* pool); // frees the slabs, so every object of the pool as well
 void duMemoryDump();
-void** duManagedMalloc(int size);
+int duFreeBlockCount(); // free blocks in the current young heap and the old heap, 2 means no fragmentation
+duStats duGetStats();   // cheap to call, walks only the free lists
+void** duManagedMalloc(int size); // may run a minor collection, so re-read Managed() pointers afterwards
+void** duManagedCalloc(int count, int size); // zeroed, skipping the clearing when the memory is still untouched
+// Where a managed block keeps handles to other managed blocks, each field is a void** or NULL
+typedef struct duType
+{
+    int handleCount;
+    const int* handleOffsets; // byte offsets of the handle fields in the block
+} duType;
+// a typed block is freed by the next collection that cannot reach it from a root through typed blocks
+// untyped blocks (type NULL, or duManagedMalloc) are roots themselves but their fields are not followed
+void** duManagedMallocTyped(int size, const duType* type);
+// the block keeps the alignment whenever a collection or duManagedRealloc moves it
+void** duManagedMallocAligned(int size, int align);
+void duAddRoot(void*** root); // root is a variable holding a handle or NULL, read at every collection
+void duRemoveRoot(void*** root);
 void duManagedInitMalloc(int searchType);
-void duManagedFree(void** mptr);
-void minorCollection();
+void duManagedInitMallocSize(int searchType, size_t heapSize);
+void duManagedFree(void** mptr); // *mptr reads NULL until the slot is handed out again
+// like duRealloc, but the handle stays the same when the block moves, NULL means it could not grow
+// may collect like duManagedMalloc
+void** duManagedRealloc(void** mptr, int size);
+int duManagedMallocBatch(int size, int count, void*** out); // may collect like duManagedMalloc
+void duManagedFreeBatch(void*** mptrs, int count);          // reorders mptrs, skips handles already freed
+unsigned int duManagedGeneration(void** mptr);             // remember this next to a handle...
+int duManagedValid(void** mptr, unsigned int generation); // ...to check later that the handle is not stale
+void minorCollection(); // copies live young managed blocks to the other young heap, promoting old enough ones
+void majorCollection(); // compacts managed blocks in the old heap, unmanaged blocks stay where they are
+// evacuates young managed blocks for about budgetMicros, starting a new cycle when none is running
+// returns 1 until the cycle is complete, re-read Managed() pointers after each step
+// a minor collection finishes a running cycle before it starts its own
+int duCollectStep(int budgetMicros);
+void duSetPromotionAge(int age); // minor collections a block survives before promotion to the old heap
+// managed blocks of at least bytes (default 128 KiB) get a page aligned mapping of their own that
+// collections never copy and duManagedFree unmaps, 0 keeps every block in the heaps
+void duSetLargeObjectThreshold(size_t bytes);
+// minor collections copy with this many threads once the Managed List is long enough and 1 MiB of the young heap is in use, the default 1
+// keeps them serial and the to-space in Managed List order
+void duSetCollectionThreads(int threads);
+// duManagedMalloc also collects once the young heap is occupancy (0-1) full or allocationBudget bytes
+// were allocated since the last collection, 0 turns either trigger off
+void duSetCollectionPolicy(double occupancy, size_t allocationBudget);
+// Heap snapshots, every managed block with its handle's Managed List index, generation, type and alignment
+// unmanaged blocks are dropped, handles in typed blocks are rewritten but handles in untyped blocks are not
+// and registered roots still hold the old handles, so find the data again with duManagedHandle
+int duHeapSave(const char* path); // returns 0 if path cannot be written, an older snapshot there stays intact
+// replaces the heap with a snapshot saved by this build, read in whole so path may change afterwards
+// returns 0 and leaves the heap alone if path is no such snapshot, or empty if it cannot be read in or is damaged
+int duHeapLoad(const char* path);
+int duManagedIndex(void** mptr);    // position of a handle in the Managed List, kept by a save and load
+void** duManagedHandle(int index);  // the handle at that position, NULL if its slot is not in use
+int duTraceStart(const char* path); // log every call below to path, returns 0 if it cannot be opened
+void duTraceStop();
 #endif
 
 
@@ -0,0 +1,308 @@
+// Benchmarks for version3
+// Replays synthetic workloads against each duMalloc strategy and the system malloc
+// Build with: gcc -O2 -pthread mallocBenchVersion3.c duMalloc.c -lm -o mallocBench
+// Usage: mallocBench [operations per workload]
+
+#define _DEFAULT_SOURCE // wait4
+
+#include <stdio.h>  // printf
+#include <stdlib.h> // malloc, exit
+#include <string.h> // memset
+#include <math.h>   // pow
+#include <time.h>   // clock_gettime
+#include <pthread.h>
+#include <unistd.h>       // fork
+#include <sys/wait.h>     // wait4
+#include <sys/resource.h> // rusage
+#include <malloc.h>       // mallinfo2
+
+#include "duMalloc.h"
+
+#define SYSTEM_MALLOC -1 // pseudo strategy for the glibc baseline
+#define LIVE_OBJECTS 4096 // objects kept live by the steady state workloads
+#define RING_SIZE 1024    // slots between the producer and the consumer
+
+int strategy;
+int operations = 200000;
+unsigned int *latencies; // nanoseconds per call
+int latencyCount;
+unsigned long long randomState = 88172645463325252ULL;
+size_t snapshotFreeBytes; // free space inside the heap while the workload is at its peak
+double snapshotFragmentation = -1; // share of that free space outside the largest free block
+
+unsigned long long nextRandom() {
+	// xorshift, the same sequence for every allocator
+	randomState ^= randomState << 13;
+	randomState ^= randomState >> 7;
+	randomState ^= randomState << 17;
+	return randomState;
+}
+
+double nowNanos() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1e9 + now.tv_nsec;
+}
+
+void record(double start) {
+	if (latencyCount < 2 * operations) {
+		latencies[latencyCount++] = (unsigned int)(nowNanos() - start);
+	}
+}
+
+void *benchMalloc(int size) {
+	double start = nowNanos();
+	void *ptr = strategy == SYSTEM_MALLOC ? malloc(size) : duMalloc(size);
+	record(start);
+	if (ptr == NULL) {
+		printf("Allocation of %d bytes failed\n", size);
+		exit(1);
+	}
+	// touch the block like a real program would
+	memset(ptr, 0, size < 64 ? size : 64);
+	return ptr;
+}
+
+void benchFree(void *ptr) {
+	double start = nowNanos();
+	if (strategy == SYSTEM_MALLOC) {
+		free(ptr);
+	} else {
+		duFree(ptr);
+	}
+	record(start);
+}
+
+void snapshot() {
+	// called by each workload while its live set is still allocated
+	if (strategy == SYSTEM_MALLOC) {
+		snapshotFreeBytes = mallinfo2().fordblks;
+		return;
+	}
+	duStats stats = duGetStats();
+	snapshotFreeBytes = stats.freeBytes;
+	snapshotFragmentation = stats.freeBytes == 0 ? 0 : 1 - (double)stats.largestFreeBlock / stats.freeBytes;
+}
+
+int uniformSize() {
+	return 16 + nextRandom() % 49;
+}
+
+int powerLawSize() {
+	// Pareto with alpha 1.2, most blocks are small but a few reach 64 KiB
+	double u = (nextRandom() % 1000000 + 1) / 1000001.0;
+	double size = 16 / pow(u, 1 / 1.2);
+	return size > 65536 ? 65536 : (int)size;
+}
+
+void steadyState(int (*nextSize)()) {
+	// keep LIVE_OBJECTS blocks live, replacing a random one each step
+	void *live[LIVE_OBJECTS] = {0};
+	for (int i = 0; i < operations; i++) {
+		int slot = nextRandom() % LIVE_OBJECTS;
+		if (live[slot] != NULL) {
+			benchFree(live[slot]);
+		}
+		live[slot] = benchMalloc(nextSize());
+	}
+	snapshot();
+	for (int i = 0; i < LIVE_OBJECTS; i++) {
+		if (live[i] != NULL) {
+			benchFree(live[i]);
+		}
+	}
+}
+
+void uniformWorkload() {
+	steadyState(uniformSize);
+}
+
+void powerLawWorkload() {
+	steadyState(powerLawSize);
+}
+
+void mixedLifetimeWorkload() {
+	// one block in ten lives for the whole run, the rest die a few allocations later
+	int longLivedCount = operations / 10 + 1;
+	void **longLived = malloc(longLivedCount * sizeof(void *));
+	void *recent[8] = {0};
+	int kept = 0;
+	for (int i = 0; i < operations; i++) {
+		void *ptr = benchMalloc(uniformSize());
+		if (nextRandom() % 10 == 0 && kept < longLivedCount) {
+			longLived[kept++] = ptr;
+		} else {
+			int slot = i % 8;
+			if (recent[slot] != NULL) {
+				benchFree(recent[slot]);
+			}
+			recent[slot] = ptr;
+		}
+	}
+	snapshot();
+	for (int i = 0; i < 8; i++) {
+		if (recent[i] != NULL) {
+			benchFree(recent[i]);
+		}
+	}
+	for (int i = 0; i < kept; i++) {
+		benchFree(longLived[i]);
+	}
+	free(longLived);
+}
+
+// Producer/consumer: one thread allocates, another frees, through a ring of slots
+void *ring[RING_SIZE];
+int ringHead = 0;
+int ringTail = 0;
+pthread_mutex_t ringLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t ringChanged = PTHREAD_COND_INITIALIZER;
+
+void *consumer(void *arg) {
+	(void)arg;
+	for (int i = 0; i < operations; i++) {
+		pthread_mutex_lock(&ringLock);
+		while (ringTail == ringHead) {
+			pthread_cond_wait(&ringChanged, &ringLock);
+		}
+		void *ptr = ring[ringTail % RING_SIZE];
+		ringTail++;
+		pthread_cond_signal(&ringChanged);
+		pthread_mutex_unlock(&ringLock);
+		// only the producer records latencies, so this free is not timed
+		if (strategy == SYSTEM_MALLOC) {
+			free(ptr);
+		} else {
+			duFree(ptr);
+		}
+	}
+	return NULL;
+}
+
+void producerConsumerWorkload() {
+	pthread_t thread;
+	pthread_create(&thread, NULL, consumer, NULL);
+	for (int i = 0; i < operations; i++) {
+		void *ptr = benchMalloc(uniformSize());
+		pthread_mutex_lock(&ringLock);
+		while (ringHead - ringTail == RING_SIZE) {
+			pthread_cond_wait(&ringChanged, &ringLock);
+		}
+		ring[ringHead % RING_SIZE] = ptr;
+		ringHead++;
+		pthread_cond_signal(&ringChanged);
+		pthread_mutex_unlock(&ringLock);
+		if (i == operations / 2) {
+			snapshot();
+		}
+	}
+	pthread_join(thread, NULL);
+}
+
+void managedWorkload() {
+	// mixed lifetimes on the managed heap, collecting every 1000 allocations
+	// slots are replaced at random, so a block lives anywhere from one allocation to thousands
+	void **live[LIVE_OBJECTS] = {0};
+	for (int i = 0; i < operations; i++) {
+		int slot = nextRandom() % LIVE_OBJECTS;
+		double start = nowNanos();
+		if (live[slot] != NULL) {
+			duManagedFree(live[slot]);
+		}
+		live[slot] = duManagedMalloc(uniformSize());
+		if (i % 1000 == 999) {
+			minorCollection();
+		}
+		record(start);
+		if (live[slot] == NULL) {
+			printf("Managed allocation failed\n");
+			exit(1);
+		}
+	}
+	snapshot();
+}
+
+int compareLatency(const void *a, const void *b) {
+	unsigned int x = *(const unsigned int *)a;
+	unsigned int y = *(const unsigned int *)b;
+	return x < y ? -1 : x > y;
+}
+
+unsigned int percentile(double p) {
+	int index = (int)(p * (latencyCount - 1));
+	return latencies[index];
+}
+
+const char *strategyName(int s) {
+	switch (s) {
+	case FIRST_FIT: return "FIRST_FIT";
+	case BEST_FIT: return "BEST_FIT";
+	case SEGREGATED_FIT: return "SEGREGATED_FIT";
+	case BITMAP_FIT: return "BITMAP_FIT";
+	default: return "glibc malloc";
+	}
+}
+
+void runWorkload(const char *name, void (*workload)(), int s, int threaded) {
+	// run in a child so peak RSS belongs to this workload alone
+	fflush(stdout);
+	pid_t pid = fork();
+	if (pid == 0) {
+		strategy = s;
+		latencies = malloc(2 * operations * sizeof(unsigned int));
+		if (strategy != SYSTEM_MALLOC) {
+			duManagedInitMalloc(strategy | (threaded ? THREAD_SAFE : 0));
+		}
+		double start = nowNanos();
+		workload();
+		double elapsed = nowNanos() - start;
+		qsort(latencies, latencyCount, sizeof(unsigned int), compareLatency);
+		printf("%-14s %-16s %12.0f %8u %8u %8u", name, strategyName(strategy),
+			latencyCount / (elapsed / 1e9), percentile(0.5), percentile(0.99), percentile(0.999));
+		printf(" %10zu", snapshotFreeBytes / 1024);
+		if (snapshotFragmentation >= 0) {
+			printf(" %6.1f%%", 100 * snapshotFragmentation);
+		} else {
+			printf(" %7s", "-");
+		}
+		fflush(stdout);
+		exit(0);
+	}
+	int status;
+	struct rusage usage;
+	wait4(pid, &status, 0, &usage);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf("\n%s with %s did not finish\n", name, strategyName(s));
+		return;
+	}
+	printf(" %10ld\n", usage.ru_maxrss);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc > 1) {
+		operations = atoi(argv[1]);
+	}
+	printf("%d operations per workload, latencies in ns, peak RSS in KiB\n", operations);
+	printf("freeKiB is free space inside the heap at the workload's peak, frag the share of it outside the largest free block\n");
+	printf("%-14s %-16s %12s %8s %8s %8s %10s %7s %10s\n", "workload", "allocator", "ops/sec",
+		"p50", "p99", "p99.9", "freeKiB", "frag", "peakRSS");
+	int strategies[] = {FIRST_FIT, BEST_FIT, SEGREGATED_FIT, BITMAP_FIT, SYSTEM_MALLOC};
+	int count = sizeof(strategies) / sizeof(strategies[0]);
+	for (int i = 0; i < count; i++) {
+		runWorkload("uniform", uniformWorkload, strategies[i], 0);
+	}
+	for (int i = 0; i < count; i++) {
+		runWorkload("power-law", powerLawWorkload, strategies[i], 0);
+	}
+	for (int i = 0; i < count; i++) {
+		runWorkload("mixed-life", mixedLifetimeWorkload, strategies[i], 0);
+	}
+	for (int i = 0; i < count; i++) {
+		runWorkload("prod/cons", producerConsumerWorkload, strategies[i], 1);
+	}
+	// the managed heap has no system malloc equivalent
+	for (int i = 0; i < count - 1; i++) {
+		runWorkload("managed", managedWorkload, strategies[i], 0);
+	}
+	return 0;
+}
@@ -0,0 +1,201 @@
+// Replays a trace recorded with duTraceStart against any strategy
+// Build with: gcc -O2 -pthread mallocReplayVersion3.c duMalloc.c -o mallocReplay
+// Usage: mallocReplay trace [FIRST_FIT|BEST_FIT|SEGREGATED_FIT|BITMAP_FIT]
+//   without a strategy the one in the trace is used
+
+#include <stdio.h>  // printf
+#include <stdlib.h> // exit
+#include <string.h> // strcmp
+#include <time.h>   // clock_gettime
+
+#include "duMalloc.h"
+
+#define SAMPLE_EVERY 1024 // events between fragmentation samples
+
+void **objects = NULL; // block or handle for each trace id
+size_t objectCount = 0;
+
+double nowSeconds() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+void remember(unsigned int id, void *object) {
+	if (id >= objectCount) {
+		size_t newCount = objectCount == 0 ? 1024 : objectCount;
+		while (newCount <= id) {
+			newCount *= 2;
+		}
+		objects = realloc(objects, newCount * sizeof(void *));
+		if (objects == NULL) {
+			printf("Out of memory for the id table\n");
+			exit(1);
+		}
+		memset(objects + objectCount, 0, (newCount - objectCount) * sizeof(void *));
+		objectCount = newCount;
+	}
+	objects[id] = object;
+}
+
+void *forget(unsigned int id) {
+	if (id >= objectCount) {
+		return NULL;
+	}
+	void *object = objects[id];
+	objects[id] = NULL;
+	return object;
+}
+
+int parseStrategy(const char *name) {
+	if (strcmp(name, "FIRST_FIT") == 0) return FIRST_FIT;
+	if (strcmp(name, "BEST_FIT") == 0) return BEST_FIT;
+	if (strcmp(name, "SEGREGATED_FIT") == 0) return SEGREGATED_FIT;
+	if (strcmp(name, "BITMAP_FIT") == 0) return BITMAP_FIT;
+	printf("Unknown strategy %s\n", name);
+	exit(1);
+}
+
+int main(int argc, char *argv[]) {
+	if (argc < 2) {
+		printf("Usage: %s trace [FIRST_FIT|BEST_FIT|SEGREGATED_FIT|BITMAP_FIT]\n", argv[0]);
+		return 1;
+	}
+	FILE *trace = fopen(argv[1], "rb");
+	char magic[8];
+	if (trace == NULL || fread(magic, 1, 8, trace) != 8 || memcmp(magic, DU_TRACE_MAGIC, 8) != 0) {
+		printf("%s is not a duMalloc trace\n", argv[1]);
+		return 1;
+	}
+	int strategy = argc > 2 ? parseStrategy(argv[2]) : -1;
+
+	duTraceEvent events[4096];
+	size_t count;
+	long long replayed = 0;
+	long long failures = 0;
+	long long tracedFailures = 0;
+	double callSeconds = 0;
+	size_t peakLive = 0;
+	double worstFragmentation = 0;
+	int align = 0; // alignment of the next allocation, 0 for none
+	while ((count = fread(events, sizeof(duTraceEvent), 4096, trace)) > 0) {
+		for (size_t i = 0; i < count; i++) {
+			duTraceEvent *event = &events[i];
+			double start = nowSeconds();
+			void *result = NULL;
+			int allocation = 0;
+			int resize = 0;
+			switch (event->op) {
+			case DU_TRACE_INIT: {
+				int traced = event->strategy;
+				int flags = traced & THREAD_SAFE;
+				size_t heapSize = event->heapSize;
+				int use = (strategy >= 0 ? strategy : (traced & ~THREAD_SAFE)) | flags;
+				if (heapSize == 0) {
+					duManagedInitMalloc(use);
+				} else {
+					duManagedInitMallocSize(use, heapSize);
+				}
+				objectCount = 0;
+				free(objects);
+				objects = NULL;
+				break;
+			}
+			case DU_TRACE_MALLOC:
+				result = align != 0 ? duMallocAligned(event->size, align) : duMalloc(event->size);
+				align = 0;
+				allocation = 1;
+				break;
+			case DU_TRACE_MANAGED_MALLOC:
+				result = align != 0 ? duManagedMallocAligned(event->size, align) : duManagedMalloc(event->size);
+				align = 0;
+				allocation = 1;
+				break;
+			case DU_TRACE_FREE: {
+				void *ptr = forget(event->id);
+				if (ptr != NULL) {
+					duFree(ptr);
+				}
+				break;
+			}
+			case DU_TRACE_MANAGED_FREE: {
+				void **mptr = forget(event->id);
+				if (mptr != NULL) {
+					duManagedFree(mptr);
+				}
+				break;
+			}
+			case DU_TRACE_REALLOC: {
+				void *ptr = forget(event->id);
+				if (ptr != NULL) {
+					result = duRealloc(ptr, event->size);
+					resize = 1;
+					remember(event->id, result != NULL ? result : ptr);
+				}
+				break;
+			}
+			case DU_TRACE_MANAGED_REALLOC: {
+				void **mptr = forget(event->id);
+				if (mptr != NULL) {
+					result = duManagedRealloc(mptr, event->size);
+					resize = 1;
+					remember(event->id, mptr);
+				}
+				break;
+			}
+			case DU_TRACE_ALIGN:
+				align = event->size;
+				break;
+			case DU_TRACE_MINOR:
+				minorCollection();
+				break;
+			case DU_TRACE_MAJOR:
+				majorCollection();
+				break;
+			case DU_TRACE_STEP:
+				duCollectStep(event->size);
+				break;
+			default:
+				printf("Unknown event %d at %lld\n", (int)event->op, replayed);
+				return 1;
+			}
+			callSeconds += nowSeconds() - start;
+			if (resize && result == NULL) {
+				failures++;
+				printf("Resize to %u bytes failed at event %lld (%.6f s into the trace)\n",
+					event->size, replayed, event->time / 1e9);
+			}
+			if (allocation) {
+				if (event->id == 0) {
+					tracedFailures++;
+				}
+				if (result == NULL) {
+					failures++;
+					printf("Allocation of %u bytes failed at event %lld (%.6f s into the trace)\n",
+						event->size, replayed, event->time / 1e9);
+				} else if (event->id != 0) {
+					remember(event->id, result);
+				}
+			}
+			replayed++;
+			if (replayed % SAMPLE_EVERY == 0) {
+				duStats stats = duGetStats();
+				double fragmentation = stats.freeBytes == 0 ? 0 : 1 - (double)stats.largestFreeBlock / stats.freeBytes;
+				peakLive = stats.liveBytes > peakLive ? stats.liveBytes : peakLive;
+				worstFragmentation = fragmentation > worstFragmentation ? fragmentation : worstFragmentation;
+			}
+		}
+	}
+	fclose(trace);
+
+	duStats stats = duGetStats();
+	peakLive = stats.liveBytes > peakLive ? stats.liveBytes : peakLive;
+	printf("%lld events replayed in %.3f s of allocator time\n", replayed, callSeconds);
+	printf("%lld allocations failed (%lld failed when traced)\n", failures, tracedFailures);
+	printf("peak live %zu bytes, live at end %zu bytes\n", peakLive, stats.liveBytes);
+	printf("worst fragmentation %.1f%%, free blocks at end %zu, largest free block %zu of %zu free bytes\n",
+		100 * worstFragmentation, stats.freeBlocks, stats.largestFreeBlock, stats.freeBytes);
+	printf("%zu minor and %zu major collections, %zu bytes copied, %.1f us max pause\n",
+		stats.minorCollections, stats.majorCollections, stats.totalBytesCopied, stats.maxPauseMicros);
+	return 0;
+}
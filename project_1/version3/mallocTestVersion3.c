@@ -3,6 +3,9 @@
 
 #include <stdio.h>  // printf
 #include <stdlib.h>  // exit
+#include <pthread.h>  // threads freeing each other's blocks
+#include <string.h>  // memcmp
+#include <stddef.h>  // offsetof
 
 // Load in the dumalloc interface
 // Will need to be compiled with the dumalloc code as well
@@ -10,6 +13,156 @@
 //   and link with that.  See the makefile.
 #include "duMalloc.h"
 
+// Stop the run with a message when a check fails
+void expect(int ok, const char* what) {
+	if (!ok) {
+		printf("Check failed: %s\n", what);
+		exit(1);
+	}
+}
+
+// Fill a block with a pattern that depends on its number, so blocks that got mixed up are caught too
+void fillBlock(unsigned char* block, int size, int number) {
+	for (int i = 0; i < size; i++) {
+		block[i] = (unsigned char)(number * 31 + i);
+	}
+}
+
+int blockIntact(unsigned char* block, int size, int number) {
+	for (int i = 0; i < size; i++) {
+		if (block[i] != (unsigned char)(number * 31 + i)) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Managed blocks of mixed sizes filled by number, shared by the collection tests
+#define MAX_FILLED 16000
+Managed_t(unsigned char*) filled[MAX_FILLED];
+
+int filledSize(int number) {
+	return 8 + (number * 37) % 200;
+}
+
+// Allocate and fill filled[first] up to filled[last - 1]
+void fillHandles(int first, int last) {
+	for (int i = first; i < last; i++) {
+		filled[i] = (Managed_t(unsigned char*))duManagedMalloc(filledSize(i));
+		expect(filled[i] != NULL, "duManagedMalloc");
+		fillBlock(Managed(filled[i]), filledSize(i), i);
+	}
+}
+
+// Free every step-th filled block from first on, below count
+void freeHandles(int first, int step, int count) {
+	for (int i = first; i < count; i += step) {
+		if (filled[i] != NULL) {
+			duManagedFree((Managed_t(void*))filled[i]);
+			filled[i] = NULL;
+		}
+	}
+}
+
+void expectHandlesIntact(int count, const char* what) {
+	for (int i = 0; i < count; i++) {
+		expect(filled[i] == NULL || blockIntact(Managed(filled[i]), filledSize(i), i), what);
+	}
+}
+
+#define CROSS_BLOCKS 300
+unsigned char* crossBlocks[CROSS_BLOCKS];
+pthread_barrier_t crossBarrier;
+
+int crossSize(int number) {
+	return 8 + (number % 8) * 8;
+}
+
+// Allocate blocks, wait while the main thread frees them, then exit
+void* allocateForOthers(void* arg) {
+	(void)arg;
+	for (int i = 0; i < CROSS_BLOCKS; i++) {
+		crossBlocks[i] = duMalloc(crossSize(i));
+		expect(crossBlocks[i] != NULL, "duMalloc in a thread");
+		fillBlock(crossBlocks[i], crossSize(i), i);
+	}
+	pthread_barrier_wait(&crossBarrier);
+	pthread_barrier_wait(&crossBarrier);
+	return NULL;
+}
+
+// Run a thread that allocates blocks for the main thread to free, while it runs or once it has exited
+// returns the first block it got
+unsigned char* freeFromOtherThread(int afterExit) {
+	pthread_t thread;
+	pthread_barrier_init(&crossBarrier, NULL, 2);
+	expect(pthread_create(&thread, NULL, allocateForOthers, NULL) == 0, "pthread_create");
+	pthread_barrier_wait(&crossBarrier);
+	if (afterExit) {
+		pthread_barrier_wait(&crossBarrier);
+		pthread_join(thread, NULL);
+	}
+	unsigned char* first = crossBlocks[0];
+	for (int i = 0; i < CROSS_BLOCKS; i++) {
+		expect(blockIntact(crossBlocks[i], crossSize(i), i), "contents seen by another thread");
+		duFree(crossBlocks[i]);
+	}
+	if (!afterExit) {
+		pthread_barrier_wait(&crossBarrier);
+		pthread_join(thread, NULL);
+	}
+	pthread_barrier_destroy(&crossBarrier);
+	return first;
+}
+
+#define TRACE_PATH "duMallocTest.trace"
+
+// A typed list node, the collector follows its next handle
+typedef struct listNode {
+	void** next;  // handle of the next node, NULL at the end
+	int value;
+} listNode;
+
+const int listNodeHandles[] = { offsetof(listNode, next) };
+const duType listNodeType = { 1, listNodeHandles };
+
+Managed_t(listNode*) newListNode(Managed_t(listNode*) next, int value) {
+	Managed_t(listNode*) node = (Managed_t(listNode*))duManagedMallocTyped(sizeof(listNode), &listNodeType);
+	expect(node != NULL, "duManagedMallocTyped");
+	Managed(node)->next = (void**)next;
+	Managed(node)->value = value;
+	return node;
+}
+
+// The list from head holds 0, 1, ... length - 1
+int listIntact(Managed_t(listNode*) head, int length) {
+	int value = 0;
+	for (Managed_t(listNode*) node = head; node != NULL; node = (Managed_t(listNode*))Managed(node)->next) {
+		if (Managed(node)->value != value) {
+			return 0;
+		}
+		value++;
+	}
+	return value == length;
+}
+
+#define SNAPSHOT_PATH "duMallocTest.heap"
+#define COPY_PATH "duMallocTestCopy.heap"  // damaged copies, the loaded snapshot stays as it was
+
+// Write a copy of the snapshot cut off at length, with flipCount bytes from flipAt changed
+void writeDamagedSnapshot(const char* path, unsigned char* image, long length, long flipAt, int flipCount) {
+	FILE* file = fopen(path, "wb");
+	expect(file != NULL, "open a damaged snapshot");
+	for (int i = 0; i < flipCount; i++) {
+		image[flipAt + i] ^= 0xA5;
+	}
+	fwrite(image, 1, length, file);
+	fclose(file);
+	for (int i = 0; i < flipCount; i++) {
+		image[flipAt + i] ^= 0xA5;
+	}
+}
+
 void test() {
 	printf("\nduMalloc a0\n");
 	Managed_t(char*) a0 = (Managed_t(char*))duManagedMalloc(128);
@@ -105,6 +258,681 @@ void test() {
 
 }
 
+// Best fit and segregated fit take the hole the request fits best,
+// even when a bigger hole leads the free list
+void testFitChoice() {
+	printf("\n********* FIT CHOICE ***********\n");
+	const int strategies[] = { BEST_FIT, SEGREGATED_FIT };
+	for (int s = 0; s < 2; s++) {
+		duInitMalloc(strategies[s]);
+		unsigned char* big = duMalloc(200);
+		unsigned char* fence = duMalloc(16);
+		unsigned char* small = duMalloc(64);
+		unsigned char* lastFence = duMalloc(16);
+		expect(big != NULL && fence != NULL && small != NULL && lastFence != NULL, "duMalloc");
+		fillBlock(fence, 16, 1);
+		fillBlock(lastFence, 16, 2);
+		duFree(small);
+		duFree(big);
+		expect(duMalloc(32) == small, "the small hole serves the small request");
+		expect(duMalloc(120) == big, "the big hole serves the bigger request");
+		expect(blockIntact(fence, 16, 1) && blockIntact(lastFence, 16, 2), "neighbours untouched");
+	}
+	printf("best and segregated fit took the tightest holes\n");
+}
+
+// Neighbours freed in any order join back into the free block they were carved from
+void testCoalescing() {
+	printf("\n********* COALESCING ***********\n");
+	duInitMalloc(FIRST_FIT);
+	int freeBlocks = duFreeBlockCount();
+	void* blocks[6];
+	for (int i = 0; i < 6; i++) {
+		blocks[i] = duMalloc(40 + 8 * i);
+		expect(blocks[i] != NULL, "duMalloc");
+	}
+	const int order[] = { 1, 4, 0, 2, 5, 3 };
+	for (int i = 0; i < 6; i++) {
+		duFree(blocks[order[i]]);
+	}
+	expect(duFreeBlockCount() == freeBlocks, "freed neighbours joined");
+	printf("%d free blocks before and after\n", freeBlocks);
+}
+
+// The heap starts at 1 KiB and grows for whatever the program asks for
+void testGrowth() {
+	printf("\n********* HEAP GROWTH ***********\n");
+	duInitMalloc(FIRST_FIT);
+	unsigned char* blocks[64];
+	for (int i = 0; i < 64; i++) {
+		blocks[i] = duMalloc(1000 + i * 100);
+		expect(blocks[i] != NULL, "duMalloc past the default heap size");
+		fillBlock(blocks[i], 1000 + i * 100, i);
+	}
+	for (int i = 0; i < 64; i++) {
+		expect(blockIntact(blocks[i], 1000 + i * 100, i), "contents after growing");
+	}
+	for (int i = 0; i < 64; i++) {
+		duFree(blocks[i]);
+	}
+	printf("heap grew to hold 64 blocks of 1000 to 7300 bytes\n");
+}
+
+// Blocks freed by a thread other than their owner go back to the heap once the owner exits,
+// and the next thread takes its blocks from that space again
+void testCrossThreadFree() {
+	printf("\n********* CROSS THREAD FREES ***********\n");
+	duInitMalloc(FIRST_FIT | THREAD_SAFE);
+	int freeBlocks = duFreeBlockCount();
+	unsigned char* first = freeFromOtherThread(0);
+	expect(duFreeBlockCount() == freeBlocks, "the exited thread's blocks went back to the heap");
+	expect(freeFromOtherThread(0) == first, "the next thread reused the same space");
+	expect(duFreeBlockCount() == freeBlocks, "the second thread's blocks went back to the heap");
+	// nobody drains the list of a thread that has exited, so these frees have to go to the heap
+	freeFromOtherThread(1);
+	expect(duFreeBlockCount() == freeBlocks, "blocks freed after their thread exited went back to the heap");
+	printf("%d blocks freed by the main thread went back to the heap\n", CROSS_BLOCKS);
+}
+
+// Minor collections move live managed blocks with their contents, raw duMalloc blocks stay put
+void testCollections() {
+	printf("\n********* CONTENTS ACROSS COLLECTIONS ***********\n");
+	const int count = 300;
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	unsigned char* raw = duMalloc(100);
+	expect(raw != NULL, "duMalloc");
+	fillBlock(raw, 100, count);
+	fillHandles(0, count);
+	for (int round = 0; round < 6; round++) {
+		// garbage between the survivors, and some survivors dying on the way
+		for (int i = 0; i < 50; i++) {
+			duManagedFree(duManagedMalloc(24 + i));
+		}
+		freeHandles(round * 2, 13, count);
+		unsigned char* before = Managed(filled[1]);
+		minorCollection();
+		// the heap has room for everything, so this is the first collection and the block is still young
+		expect(round > 0 || Managed(filled[1]) != before, "the collection moved the managed blocks");
+		expectHandlesIntact(count, "contents after a collection");
+	}
+	expect(blockIntact(raw, 100, count), "raw block untouched by the collections");
+	printf("contents kept across minor collections\n");
+}
+
+// Right after a collection the young heap hands out blocks one after the other
+void testBumpAllocation() {
+	printf("\n********* BUMP ALLOCATION ***********\n");
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	fillHandles(0, 50);
+	freeHandles(0, 2, 50);
+	minorCollection();
+	int freeBlocks = duFreeBlockCount();
+	unsigned char* previous = NULL;
+	for (int i = 50; i < 150; i++) {
+		fillHandles(i, i + 1);
+		expect(Managed(filled[i]) > previous, "each block after the one before");
+		previous = Managed(filled[i]);
+	}
+	expect(duFreeBlockCount() == freeBlocks, "bumping leaves the free list alone");
+	expectHandlesIntact(150, "contents of bumped blocks");
+	printf("100 blocks bumped in address order\n");
+}
+
+// Blocks that survive enough minor collections are promoted and stop moving,
+// until a major collection slides them over the holes left among them
+void testPromotion() {
+	printf("\n********* PROMOTION AND COMPACTION ***********\n");
+	const int count = 200;
+	unsigned char* promoted[200];
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	duSetPromotionAge(2);
+	fillHandles(0, count);
+	minorCollection();
+	minorCollection();
+	for (int i = 0; i < count; i++) {
+		promoted[i] = Managed(filled[i]);
+	}
+	minorCollection();
+	for (int i = 0; i < count; i++) {
+		expect(Managed(filled[i]) == promoted[i], "promoted blocks stay put in minor collections");
+	}
+	freeHandles(0, 3, count);
+	majorCollection();
+	int moved = 0;
+	for (int i = 0; i < count; i++) {
+		moved += filled[i] != NULL && Managed(filled[i]) != promoted[i];
+	}
+	expect(moved > 0, "majorCollection slid blocks down");
+	expectHandlesIntact(count, "contents after compaction");
+	printf("%d of the promoted blocks moved in the major collection\n", moved);
+}
+
+// A handle whose block was freed is stale, also once its slot serves a new block
+void testStaleHandles() {
+	printf("\n********* STALE HANDLES ***********\n");
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	void** freed = duManagedMalloc(32);
+	unsigned int generation = duManagedGeneration(freed);
+	expect(duManagedValid(freed, generation), "live handle is valid");
+	duManagedFree(freed);
+	expect(!duManagedValid(freed, generation), "freed handle is stale");
+	expect(*freed == NULL, "a freed handle reads NULL");
+	void** reused = duManagedMalloc(48);
+	expect(reused == freed, "the vacated slot is taken again");
+	expect(!duManagedValid(freed, generation), "the old generation stays stale");
+	expect(duManagedValid(reused, duManagedGeneration(reused)), "the new block's handle is valid");
+	// vacated slots are handed out again last freed first
+	void** other = duManagedMalloc(16);
+	duManagedFree(other);
+	duManagedFree(reused);
+	expect(*other == NULL && *reused == NULL, "both vacated slots read NULL");
+	expect(duManagedMalloc(16) == reused && duManagedMalloc(16) == other, "vacated slots reused last freed first");
+	printf("stale handle rejected after its slot was reused\n");
+}
+
+// Past its allocation budget duManagedMalloc collects by itself, moving the live blocks
+void testProactiveCollection() {
+	printf("\n********* PROACTIVE COLLECTION ***********\n");
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	duSetCollectionPolicy(0, 4096);
+	fillHandles(0, 20);
+	unsigned char* before = Managed(filled[0]);
+	// far less than the heap holds, so only the budget can trigger a collection
+	for (int i = 0; i < 100; i++) {
+		duManagedFree(duManagedMalloc(64));
+	}
+	expect(Managed(filled[0]) != before, "a collection ran without being asked for");
+	expectHandlesIntact(20, "contents after a proactive collection");
+	// the block handed out right after a collection for a full heap counts towards the budget
+	duSetCollectionPolicy(0, 0);
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	while (duGetStats().minorCollections == 0) {
+		duManagedMalloc(64);
+	}
+	duSetCollectionPolicy(0, 1);
+	duManagedMalloc(64);
+	expect(duGetStats().minorCollections == 2, "the block after a full heap was counted");
+	duSetCollectionPolicy(0, 0);
+	printf("the allocation budget started a collection\n");
+}
+
+// duGetStats counts the calls made since init
+void testStats() {
+	printf("\n********* STATISTICS ***********\n");
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	duStats start = duGetStats();
+	expect(start.liveBytes == 0 && start.frees == 0 && start.minorCollections == 0, "counters restart at init");
+	void* blocks[10];
+	for (int i = 0; i < 10; i++) {
+		blocks[i] = duMalloc(100);
+	}
+	for (int i = 0; i < 4; i++) {
+		duFree(blocks[i]);
+	}
+	duStats stats = duGetStats();
+	expect(stats.allocations[FIRST_FIT] - start.allocations[FIRST_FIT] == 10 && stats.frees == 4, "calls counted");
+	expect(stats.bytesAllocated >= 10 * 100 && stats.bytesFreed >= 4 * 100, "bytes counted");
+	expect(stats.liveBytes == stats.bytesAllocated - stats.bytesFreed, "live bytes");
+	minorCollection();
+	minorCollection();
+	majorCollection();
+	stats = duGetStats();
+	expect(stats.minorCollections == 2 && stats.majorCollections == 1, "collections counted");
+	printf("%zu live bytes in 6 blocks\n", stats.liveBytes);
+}
+
+// freeBytes drops by what a block takes and comes back when it is freed
+void testFreeBytes() {
+	printf("\n********* FREE BYTES ***********\n");
+	duInitMalloc(FIRST_FIT);
+	size_t freeBytes = duGetStats().freeBytes;
+	void* block = duMalloc(200);
+	expect(block != NULL, "duMalloc");
+	expect(duGetStats().freeBytes + 200 <= freeBytes, "the block's bytes are taken");
+	duFree(block);
+	expect(duGetStats().freeBytes == freeBytes, "the block's bytes came back");
+	printf("%zu free bytes before and after\n", freeBytes);
+}
+
+// A trace names each block by an id and records the calls in order
+void testTrace() {
+	printf("\n********* TRACING ***********\n");
+	duInitMallocSize(FIRST_FIT, 1000);
+	// the INIT event records the size given to init, not the size the heap has grown to since
+	duFree(duMalloc(5000));
+	expect(duTraceStart(TRACE_PATH), "duTraceStart");
+	void* first = duMalloc(100);
+	void* second = duMalloc(200);
+	duFree(first);
+	duFree(second);
+	duTraceStop();
+	const duTraceEvent expected[] = {
+		{ .op = DU_TRACE_INIT, .strategy = FIRST_FIT, .heapSize = 1000 },
+		{ .op = DU_TRACE_MALLOC, .id = 1, .size = 100 },
+		{ .op = DU_TRACE_MALLOC, .id = 2, .size = 200 },
+		{ .op = DU_TRACE_FREE, .id = 1, .size = 0 },
+		{ .op = DU_TRACE_FREE, .id = 2, .size = 0 },
+	};
+	FILE* file = fopen(TRACE_PATH, "rb");
+	expect(file != NULL, "open the trace");
+	char magic[8];
+	expect(fread(magic, 1, 8, file) == 8 && memcmp(magic, DU_TRACE_MAGIC, 8) == 0, "trace magic");
+	duTraceEvent events[6];
+	expect(fread(events, sizeof(duTraceEvent), 6, file) == 5, "one event per call");
+	fclose(file);
+	remove(TRACE_PATH);
+	expect(events[0].op == DU_TRACE_INIT && events[0].strategy == expected[0].strategy && events[0].heapSize == expected[0].heapSize,
+		"INIT records the strategy and the size given to init");
+	for (int i = 1; i < 5; i++) {
+		expect(events[i].op == expected[i].op && events[i].id == expected[i].id, "event order and ids");
+		expect(events[i].size == expected[i].size, "requested sizes");
+	}
+	printf("5 events traced\n");
+}
+
+// Blocks bumped one after the other sit their size plus the block overhead apart
+void testHeaderOverhead() {
+	printf("\n********* BLOCK OVERHEAD ***********\n");
+#ifdef COMPACT_HEADER
+	const int overhead = 16;  // a size word before the payload and a tag after it
+#else
+	const int overhead = 40;  // a 32 byte header and a footer
+#endif
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	void** first = duManagedMalloc(64);
+	void** second = duManagedMalloc(64);
+	expect(first != NULL && second != NULL, "duManagedMalloc");
+	expect((unsigned char*)*second - (unsigned char*)*first == 64 + overhead, "block overhead");
+	printf("%d bytes of overhead per block\n", overhead);
+}
+
+// Bitmap fit takes the lowest hole that fits, whatever order the holes were freed in
+void testBitmapFit() {
+	printf("\n********* BITMAP FIT ***********\n");
+	duInitMalloc(BITMAP_FIT);
+	unsigned char* low = duMalloc(64);
+	unsigned char* fence = duMalloc(16);
+	unsigned char* high = duMalloc(64);
+	unsigned char* lastFence = duMalloc(16);
+	expect(low != NULL && fence != NULL && high != NULL && lastFence != NULL, "duMalloc");
+	duFree(low);
+	duFree(high);
+	// wider than either hole, so it comes from the space after them
+	expect((unsigned char*)duMalloc(100) > lastFence, "a wider request skips the narrow holes");
+	expect(duMalloc(64) == low, "the lower hole first");
+	expect(duMalloc(64) == high, "then the higher one");
+	printf("holes taken in address order\n");
+}
+
+// Among many holes best fit finds the one of exactly the requested size
+void testBestFitHoles() {
+	printf("\n********* BEST FIT AMONG MANY HOLES ***********\n");
+	const int count = 40;
+	unsigned char* holes[40];
+	int sizes[40];
+	duInitMalloc(BEST_FIT);
+	for (int i = 0; i < count; i++) {
+		// 17 and 40 share no factor, so every size from 16 to 328 comes up once
+		sizes[i] = 16 + (i * 17) % count * 8;
+		holes[i] = duMalloc(sizes[i]);
+		expect(holes[i] != NULL && duMalloc(8) != NULL, "duMalloc");
+	}
+	for (int i = 0; i < count; i++) {
+		duFree(holes[i]);
+	}
+	const int requests[] = { 100, 17, 328, 200, 61 };
+	for (int r = 0; r < 5; r++) {
+		int wanted = (requests[r] + 7) & ~7;
+		int hole = 0;
+		while (sizes[hole] != wanted) {
+			hole++;
+		}
+		expect(duMalloc(requests[r]) == holes[hole], "the hole of the rounded up size");
+	}
+	printf("5 requests served by exactly fitting holes\n");
+}
+
+// A batch is carved from one region, so freeing it leaves a single free block again
+void testBatches() {
+	printf("\n********* BATCHES ***********\n");
+	unsigned char* batch[100];
+	duInitMalloc(FIRST_FIT);
+	int freeBlocks = duFreeBlockCount();
+	expect(duMallocBatch(48, 100, (void**)batch) == 100, "duMallocBatch");
+	for (int i = 0; i < 100; i++) {
+		fillBlock(batch[i], 48, i);
+	}
+	for (int i = 0; i < 100; i++) {
+		expect(blockIntact(batch[i], 48, i), "batch blocks do not overlap");
+	}
+	duFreeBatch((void**)batch, 100);
+	expect(duFreeBlockCount() == freeBlocks, "the freed batch joined into one block");
+	printf("100 blocks allocated and freed as one region\n");
+}
+
+// A pool packs objects without headers and hands out the last freed object first
+void testPools() {
+	printf("\n********* POOLS ***********\n");
+	unsigned char* objects[500];
+	duInitMalloc(FIRST_FIT);
+	int freeBlocks = duFreeBlockCount();
+	duPool* pool = duPoolCreate(24);
+	expect(pool != NULL, "duPoolCreate");
+	for (int i = 0; i < 500; i++) {
+		objects[i] = duPoolAlloc(pool);
+		expect(objects[i] != NULL, "duPoolAlloc");
+		fillBlock(objects[i], 24, i);
+	}
+	expect(objects[1] - objects[0] == 24, "objects packed without a header");
+	for (int i = 0; i < 500; i += 3) {
+		duPoolFree(pool, objects[i]);
+	}
+	for (int i = 1; i < 500; i++) {
+		expect(i % 3 == 0 || blockIntact(objects[i], 24, i), "contents of the other objects");
+	}
+	expect(duPoolAlloc(pool) == objects[498], "the last freed object comes back first");
+	duPoolDestroy(pool);
+	expect(duFreeBlockCount() == freeBlocks, "destroying the pool gave its slabs back");
+	printf("500 objects in a pool of 24 byte slots\n");
+}
+
+// Evacuating with several threads keeps the same blocks and contents as the serial path
+// only where the copies land in the to-space may differ
+size_t evacuateWithThreads(int threads) {
+	const int count = 16000;
+	// big enough that only the collections below run, so every thread count starts from the same heap
+	// and that the first two have more than the 1 MiB in use below which evacuation stays serial
+	duManagedInitMallocSize(SEGREGATED_FIT, 4 << 20);
+	duSetCollectionThreads(threads);
+	fillHandles(0, count);
+	freeHandles(0, 5, count);
+	expect(duGetStats().minorCollections == 0, "no collection while filling the heap");
+	// the second collection also promotes, with the default promotion age of 2
+	for (int round = 0; round < 3; round++) {
+		minorCollection();
+		expectHandlesIntact(count, "contents after a parallel collection");
+	}
+	duSetCollectionThreads(1);
+	return duGetStats().liveBytes;
+}
+
+void testParallelEvacuation() {
+	printf("\n********* PARALLEL EVACUATION ***********\n");
+	size_t serialLiveBytes = evacuateWithThreads(1);
+	expect(evacuateWithThreads(4) == serialLiveBytes, "liveBytes with 4 threads");
+	expect(evacuateWithThreads(8) == serialLiveBytes, "liveBytes with 8 threads");
+	printf("1, 4 and 8 collection threads agree, %zu live bytes\n", serialLiveBytes);
+}
+
+// A cycle run through many small duCollectStep calls, with the program allocating
+// and freeing between the steps, is one collection and keeps every live handle's contents
+void testIncrementalSteps() {
+	printf("\n********* INCREMENTAL COLLECTION ***********\n");
+	const int count = 2000;
+	duManagedInitMallocSize(FIRST_FIT, 1 << 20);
+	fillHandles(0, count);
+	int steps = 0;
+	int added = count;
+	// a zero budget evacuates one batch of 64 slots per step
+	while (duCollectStep(0)) {
+		steps++;
+		// free one block the cycle has not reached yet and one it may already have moved
+		freeHandles((steps * 97) % count, count, count);
+		freeHandles((steps * 13) % count, count, count);
+		if (added < count + 64) {
+			fillHandles(added, added + 1);
+			added++;
+		}
+		expectHandlesIntact(added, "contents between steps");
+	}
+	expect(steps + 1 >= count / 64, "one step per batch of slots");
+	expect(duGetStats().minorCollections == 1, "the steps made one collection");
+	// the blocks allocated mid-cycle survive the next collection too
+	minorCollection();
+	expectHandlesIntact(added, "contents after the cycle");
+	printf("contents kept across a cycle of %d steps\n", steps + 1);
+}
+
+// Typed blocks nothing reaches are freed by the next collection, even when they point at each other,
+// while blocks reachable from a pushed root survive however deep they are
+void testReachability() {
+	printf("\n********* UNREACHABLE TYPED BLOCKS ***********\n");
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	Managed_t(listNode*) head = NULL;
+	for (int i = 4; i >= 0; i--) {
+		head = newListNode(head, i);
+	}
+	duAddRoot((void***)&head);
+	// a cycle of two nodes, and a short chain nothing points at
+	Managed_t(listNode*) first = newListNode(NULL, 100);
+	Managed_t(listNode*) second = newListNode(first, 101);
+	Managed(first)->next = (void**)second;
+	Managed_t(listNode*) dangling = newListNode(newListNode(NULL, 103), 102);
+	unsigned int firstGeneration = duManagedGeneration((void**)first);
+	unsigned int danglingGeneration = duManagedGeneration((void**)dangling);
+	duStats before = duGetStats();
+	minorCollection();
+	duStats after = duGetStats();
+	expect(after.blocksReclaimed - before.blocksReclaimed == 4, "the cycle and the chain were freed");
+	// a list node is 16 bytes, no block rounds it up
+	expect(after.bytesFreed - before.bytesFreed == 4 * sizeof(listNode), "their bytes were freed");
+	expect(!duManagedValid((void**)first, firstGeneration) && !duManagedValid((void**)dangling, danglingGeneration), "their handles are stale");
+	// the list survives this collection and the ones that promote it
+	minorCollection();
+	minorCollection();
+	expect(listIntact(head, 5), "rooted list contents");
+	// once the root is gone, the whole list goes with the next collection
+	before = duGetStats();
+	duRemoveRoot((void***)&head);
+	minorCollection();
+	expect(duGetStats().blocksReclaimed - before.blocksReclaimed == 5, "the list was freed after its root was removed");
+	printf("unreachable typed blocks freed, rooted ones kept\n");
+}
+
+// duRealloc grows into a free neighbour and shrinks in place, and moves only when it must
+void testRealloc() {
+	printf("\n********* REALLOC ***********\n");
+	duInitMalloc(FIRST_FIT);
+	unsigned char* block = duMalloc(64);
+	unsigned char* neighbour = duMalloc(64);
+	unsigned char* fence = duMalloc(16);
+	expect(block != NULL && neighbour != NULL && fence != NULL, "duMalloc");
+	fillBlock(block, 64, 1);
+	duFree(neighbour);
+	expect(duRealloc(block, 120) == block && blockIntact(block, 64, 1), "grown into the free neighbour");
+	expect(duRealloc(block, 32) == block && blockIntact(block, 32, 1), "shrunk in place");
+	unsigned char* moved = duRealloc(block, 1000);
+	expect(moved != NULL && moved != block && blockIntact(moved, 32, 1), "moved with its contents");
+	duFree(moved);
+	duFree(fence);
+	// a managed block keeps its handle when it moves
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	Managed_t(unsigned char*) handle = (Managed_t(unsigned char*))duManagedMalloc(64);
+	expect(handle != NULL && duManagedMalloc(16) != NULL, "duManagedMalloc");
+	fillBlock(Managed(handle), 64, 2);
+	unsigned char* before = Managed(handle);
+	expect(duManagedRealloc((void**)handle, 500) == (void**)handle, "the handle stays");
+	expect(Managed(handle) != before && blockIntact(Managed(handle), 64, 2), "the managed block moved with its contents");
+	printf("realloc stayed in place until the neighbour was in the way\n");
+}
+
+// Aligned managed blocks keep their alignment when collections copy, promote and compact them
+void testAlignment() {
+	printf("\n********* ALIGNMENT ***********\n");
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	unsigned char* raw = duMallocAligned(100, 256);
+	expect(raw != NULL && ((size_t)raw & 255) == 0, "duMallocAligned");
+	expect(duMallocAligned(100, 48) == NULL, "an alignment that is no power of two");
+	Managed_t(unsigned char*) aligned[8];
+	for (int i = 0; i < 8; i++) {
+		// odd sized blocks in between, so a copy that ignored the alignment would lose it
+		expect(duManagedMalloc(8 + i * 24) != NULL, "duManagedMalloc");
+		aligned[i] = (Managed_t(unsigned char*))duManagedMallocAligned(24 + i * 40, 64 << (i % 4));
+		expect(aligned[i] != NULL, "duManagedMallocAligned");
+		fillBlock(Managed(aligned[i]), 24 + i * 40, i);
+	}
+	for (int round = 0; round < 4; round++) {
+		minorCollection();
+		if (round == 3) {
+			majorCollection();
+		}
+		for (int i = 0; i < 8; i++) {
+			expect(((size_t)Managed(aligned[i]) & ((64 << (i % 4)) - 1)) == 0, "alignment after a collection");
+			expect(blockIntact(Managed(aligned[i]), 24 + i * 40, i), "contents after a collection");
+		}
+	}
+	printf("8 aligned blocks kept their alignment\n");
+}
+
+// A large block gets a mapping of its own, collections never copy it and duManagedFree unmaps it
+void testLargeObjects() {
+	printf("\n********* LARGE OBJECTS ***********\n");
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	Managed_t(unsigned char*) large = (Managed_t(unsigned char*))duManagedMalloc(300000);
+	expect(large != NULL, "duManagedMalloc");
+	fillBlock(Managed(large), 300000, 1);
+	unsigned char* at = Managed(large);
+	duStats stats = duGetStats();
+	expect(stats.largeObjects == 1 && stats.largeObjectBytes >= 300000, "mapped on its own");
+	for (int round = 0; round < 3; round++) {
+		minorCollection();
+		majorCollection();
+		expect(Managed(large) == at, "never copied");
+	}
+	expect(blockIntact(Managed(large), 300000, 1), "contents after the collections");
+	duManagedFree((void**)large);
+	stats = duGetStats();
+	expect(stats.largeObjects == 0 && stats.largeObjectBytes == 0, "unmapped by duManagedFree");
+	printf("large block stayed at %p until freed\n", (void*)at);
+}
+
+int allZero(unsigned char* block, int size) {
+	for (int i = 0; i < size; i++) {
+		if (block[i] != 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// Calloc clears memory that was used before, and refuses sizes that overflow an int
+void testCalloc() {
+	printf("\n********* CALLOC ***********\n");
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	unsigned char* dirty = duMalloc(256);
+	expect(dirty != NULL, "duMalloc");
+	memset(dirty, 0xFF, 256);
+	duFree(dirty);
+	unsigned char* cleared = duCalloc(32, 8);
+	expect(cleared == dirty && allZero(cleared, 256), "the reused block is cleared");
+	expect(duCalloc(1 << 20, 1 << 12) == NULL, "an overflowing size is refused");
+	// dirty a young heap, then come back to it after two collections
+	for (int i = 0; i < 100; i++) {
+		Managed_t(unsigned char*) garbage = (Managed_t(unsigned char*))duManagedMalloc(256);
+		memset(Managed(garbage), 0xFF, 256);
+		duManagedFree((void**)garbage);
+	}
+	minorCollection();
+	minorCollection();
+	for (int i = 0; i < 100; i++) {
+		Managed_t(unsigned char*) zeroed = (Managed_t(unsigned char*))duManagedCalloc(16, 16);
+		expect(zeroed != NULL && allZero(Managed(zeroed), 256), "managed block cleared after reuse");
+	}
+	printf("reused memory came back cleared\n");
+}
+
+// A saved heap loads back with its list, aligned block and large object intact,
+// and a damaged snapshot is refused without crashing
+void testSnapshots() {
+	printf("\n********* HEAP SNAPSHOTS ***********\n");
+	duManagedInitMallocSize(FIRST_FIT, 1 << 16);
+	Managed_t(listNode*) head = NULL;
+	duAddRoot((void***)&head);
+	// the older half of the list is promoted, so the snapshot spans both heaps
+	for (int i = 39; i >= 20; i--) {
+		head = newListNode(head, i);
+	}
+	minorCollection();
+	minorCollection();
+	for (int i = 19; i >= 0; i--) {
+		head = newListNode(head, i);
+	}
+	Managed_t(unsigned char*) aligned = (Managed_t(unsigned char*))duManagedMallocAligned(300, 4096);
+	Managed_t(unsigned char*) large = (Managed_t(unsigned char*))duManagedMalloc(200000);
+	expect(aligned != NULL && large != NULL, "aligned and large blocks");
+	fillBlock(Managed(aligned), 300, 1);
+	fillBlock(Managed(large), 200000, 2);
+	int headIndex = duManagedIndex((void**)head);
+	int alignedIndex = duManagedIndex((void**)aligned);
+	int largeIndex = duManagedIndex((void**)large);
+	expect(duHeapSave(SNAPSHOT_PATH), "duHeapSave");
+
+	// keep the good snapshot in memory to damage copies of it
+	FILE* file = fopen(SNAPSHOT_PATH, "rb");
+	expect(file != NULL, "open the snapshot");
+	fseek(file, 0, SEEK_END);
+	long length = ftell(file);
+	fseek(file, 0, SEEK_SET);
+	unsigned char* image = malloc(length);
+	expect(image != NULL && fread(image, 1, length, file) == (size_t)length, "read the snapshot");
+	fclose(file);
+
+	// scribble over the heap so the load has to bring everything back
+	minorCollection();
+	for (int i = 0; i < 50; i++) {
+		duManagedMalloc(64);
+	}
+	expect(duHeapLoad(SNAPSHOT_PATH), "duHeapLoad");
+	head = (Managed_t(listNode*))duManagedHandle(headIndex);
+	aligned = (Managed_t(unsigned char*))duManagedHandle(alignedIndex);
+	large = (Managed_t(unsigned char*))duManagedHandle(largeIndex);
+	expect(head != NULL && aligned != NULL && large != NULL, "handles found again after loading");
+	expect(listIntact(head, 40), "list after loading");
+	expect(((size_t)Managed(aligned) & 4095) == 0 && blockIntact(Managed(aligned), 300, 1), "aligned block after loading");
+	expect(blockIntact(Managed(large), 200000, 2), "large block after loading");
+	// the loaded heap is a copy, emptying the file does not touch it
+	FILE* emptied = fopen(SNAPSHOT_PATH, "wb");
+	expect(emptied != NULL, "empty the snapshot");
+	fclose(emptied);
+	expect(listIntact(head, 40) && blockIntact(Managed(large), 200000, 2), "heap kept after emptying its snapshot");
+	// the loaded heap works like any other
+	minorCollection();
+	majorCollection();
+	expect(listIntact(head, 40) && blockIntact(Managed(aligned), 300, 1), "contents after collecting a loaded heap");
+
+	// a cut short file is no snapshot, the heap stays as it was
+	writeDamagedSnapshot(COPY_PATH, image, length - 100, 0, 0);
+	expect(!duHeapLoad(COPY_PATH), "truncated snapshot refused");
+	expect(listIntact(head, 40) && blockIntact(Managed(large), 200000, 2), "heap kept after a truncated snapshot");
+	writeDamagedSnapshot(COPY_PATH, image, 16, 0, 0);
+	expect(!duHeapLoad(COPY_PATH), "snapshot cut inside its header refused");
+	// a snapshot starts with its magic, and the old heap with the size of its first block a page in
+	for (long at = 0; at < 8; at++) {
+		writeDamagedSnapshot(COPY_PATH, image, length, at, 1);
+		expect(!duHeapLoad(COPY_PATH), "damaged magic refused");
+	}
+	writeDamagedSnapshot(COPY_PATH, image, length, 4096, 16);
+	expect(!duHeapLoad(COPY_PATH), "damaged block header refused");
+	// elsewhere a changed byte may just be changed data, but loading must never crash
+	for (long at = 0; at < length; at += length / 97 + 1) {
+		writeDamagedSnapshot(COPY_PATH, image, length, at, 1);
+		if (!duHeapLoad(COPY_PATH)) {
+			// a refused snapshot leaves a usable heap behind
+			expect(duManagedMalloc(100) != NULL, "allocate after a refused snapshot");
+		}
+	}
+	// and the good snapshot still loads afterwards
+	writeDamagedSnapshot(COPY_PATH, image, length, 0, 0);
+	expect(duHeapLoad(COPY_PATH), "duHeapLoad after refused snapshots");
+	head = (Managed_t(listNode*))duManagedHandle(headIndex);
+	expect(listIntact(head, 40), "list after loading again");
+	duRemoveRoot((void***)&head);
+	free(image);
+	remove(SNAPSHOT_PATH);
+	remove(COPY_PATH);
+	printf("snapshot of %ld bytes saved, loaded and damaged copies refused\n", length);
+}
+
 int main(int argc, char* argv[]) {
 
 	// Must be first call in the program to get DuMalloc going
@@ -113,4 +941,29 @@ int main(int argc, char* argv[]) {
 	duMemoryDump();
 
 	test();
+	testFitChoice();
+	testCoalescing();
+	testGrowth();
+	testCrossThreadFree();
+	testCollections();
+	testBumpAllocation();
+	testPromotion();
+	testStaleHandles();
+	testProactiveCollection();
+	testStats();
+	testFreeBytes();
+	testTrace();
+	testHeaderOverhead();
+	testBitmapFit();
+	testBestFitHoles();
+	testBatches();
+	testPools();
+	testParallelEvacuation();
+	testIncrementalSteps();
+	testReachability();
+	testRealloc();
+	testAlignment();
+	testLargeObjects();
+	testCalloc();
+	testSnapshots();
 }